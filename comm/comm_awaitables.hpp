@@ -0,0 +1,79 @@
+#pragma once
+
+#include <coro_executor.hpp>
+#include "mqtt_client.hpp"
+#include "http_downloader.hpp"
+
+/**
+ * Awaitable counterparts of the blocking comm calls, for coroutines running on a coro::executor
+ *
+ * @remark i.e. esp_err_t ret = co_await recv_cmd_awaitable{client, &pkt, pdMS_TO_TICKS(1000)};
+ * @remark Pointers handed in must stay valid until the co_await returns, they usually live in the coroutine frame
+ * @remark Point mqtt_client::set_notify_task() & http_downloader::set_notify_task() at executor::get_task(),
+ *         otherwise these only get polled every executor::POLL_PERIOD_MS
+ */
+
+struct recv_cmd_awaitable : public coro::poll_awaitable
+{
+public:
+    recv_cmd_awaitable(mqtt_client &_client, mqtt_client::mq_cmd_pkt *_pkt, uint32_t _timeout_ticks = portMAX_DELAY)
+        : client(_client), pkt(_pkt), timeout_ticks(_timeout_ticks), deadline(deadline_of(_timeout_ticks)) {}
+
+    bool poll() override
+    {
+        result = client.recv_cmd_packet(pkt, 0);
+        if (result != ESP_ERR_TIMEOUT) {
+            return true;
+        }
+
+        return expired(timeout_ticks, deadline);
+    }
+
+private:
+    mqtt_client &client;
+    mqtt_client::mq_cmd_pkt *pkt;
+    uint32_t timeout_ticks;
+    TickType_t deadline;
+};
+
+struct request_blob_awaitable : public coro::poll_awaitable
+{
+public:
+    request_blob_awaitable(mqtt_client &_client, const char *_type, uint32_t _offset, size_t _expect_blk_len, uint32_t _timeout_ticks = portMAX_DELAY)
+        : client(_client), type(_type), offset(_offset), expect_blk_len(_expect_blk_len),
+          timeout_ticks(_timeout_ticks), deadline(deadline_of(_timeout_ticks)) {}
+
+    bool poll() override
+    {
+        // Peek first, request_blob() with no time left re-arms the ready bit as if the previous chunk was lost
+        if (!client.is_blob_request_ready() && !expired(timeout_ticks, deadline)) {
+            return false;
+        }
+
+        result = client.request_blob(type, offset, expect_blk_len, 0);
+        return true;
+    }
+
+private:
+    mqtt_client &client;
+    const char *type;
+    uint32_t offset;
+    size_t expect_blk_len;
+    uint32_t timeout_ticks;
+    TickType_t deadline;
+};
+
+struct http_request_awaitable : public coro::poll_awaitable
+{
+public:
+    explicit http_request_awaitable(http_downloader &_downloader) : downloader(_downloader) {}
+
+    bool poll() override
+    {
+        result = downloader.request_step();
+        return result != ESP_ERR_HTTP_EAGAIN;
+    }
+
+private:
+    http_downloader &downloader;
+};
@@ -0,0 +1,385 @@
+#include <cstring>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <esp_log.h>
+#include <esp_heap_caps.h>
+#include "delta_patcher.hpp"
+
+esp_err_t delta_patcher::begin(const char *base_path, const uint8_t *base_sha256, const char *_out_path, bool verify_base)
+{
+    if (base_path == nullptr || base_sha256 == nullptr || _out_path == nullptr || strlen(_out_path) >= sizeof(out_path)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    abort();
+    strlcpy(out_path, _out_path, sizeof(out_path));
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", out_path);
+    memcpy(expect_base_sha256, base_sha256, sizeof(expect_base_sha256));
+
+    if (work_buf == nullptr) {
+        work_buf = (uint8_t *)heap_caps_malloc(WORK_BUF_LEN, MALLOC_CAP_SPIRAM);
+        if (work_buf == nullptr) {
+            ESP_LOGE(TAG, "Failed to alloc work buffer");
+            return ESP_ERR_NO_MEM;
+        }
+    }
+
+    base_fd = open(base_path, O_RDONLY);
+    struct stat st = {};
+    if (base_fd < 0 || fstat(base_fd, &st) != 0) {
+        ESP_LOGE(TAG, "Failed to open base %s", base_path);
+        close_files();
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    base_len = (size_t)st.st_size;
+    if (verify_base) {
+        uint8_t digest[32] = {};
+        auto ret = hash_base(digest);
+        if (ret != ESP_OK || memcmp(digest, expect_base_sha256, sizeof(digest)) != 0) {
+            ESP_LOGE(TAG, "Base image doesn't match, can't patch");
+            close_files();
+            return ret != ESP_OK ? ret : ESP_ERR_INVALID_CRC;
+        }
+    }
+
+    out_fp = fopen(tmp_path, "w");
+    if (out_fp == nullptr) {
+        ESP_LOGE(TAG, "Failed to open output %s", tmp_path);
+        close_files();
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    mbedtls_sha256_init(&sha_ctx);
+    mbedtls_sha256_starts(&sha_ctx, 0);
+    sha_started = true;
+    state = PATCH_STATE_HEADER;
+    return ESP_OK;
+}
+
+esp_err_t delta_patcher::feed(const uint8_t *buf, size_t len)
+{
+    if (buf == nullptr && len > 0) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    if (out_fp == nullptr || state == PATCH_STATE_FAILED) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    esp_err_t ret = ESP_OK;
+    while (len > 0 && ret == ESP_OK) {
+        switch (state) {
+            case PATCH_STATE_HEADER: {
+                size_t take = std::min(len, HEADER_LEN - hdr_fill);
+                memcpy(hdr_buf + hdr_fill, buf, take);
+                hdr_fill += take;
+                buf += take;
+                len -= take;
+                if (hdr_fill == HEADER_LEN) {
+                    ret = parse_header();
+                }
+                break;
+            }
+
+            case PATCH_STATE_OP: {
+                curr_op = *buf;
+                buf += 1;
+                len -= 1;
+                args_fill = 0;
+                switch (curr_op) {
+                    case PATCH_OP_END: {
+                        state = PATCH_STATE_DONE;
+                        break;
+                    }
+                    case PATCH_OP_ADD: {
+                        args_need = 4;
+                        state = PATCH_STATE_ARGS;
+                        break;
+                    }
+                    case PATCH_OP_COPY:
+                    case PATCH_OP_DIFF: {
+                        args_need = 8;
+                        state = PATCH_STATE_ARGS;
+                        break;
+                    }
+                    default: {
+                        ESP_LOGE(TAG, "Unknown op 0x%02x at out=%u", curr_op, out_len);
+                        ret = ESP_ERR_INVALID_RESPONSE;
+                        break;
+                    }
+                }
+                break;
+            }
+
+            case PATCH_STATE_ARGS: {
+                size_t take = std::min(len, args_need - args_fill);
+                memcpy(args_buf + args_fill, buf, take);
+                args_fill += take;
+                buf += take;
+                len -= take;
+                if (args_fill == args_need) {
+                    ret = start_op();
+                }
+                break;
+            }
+
+            case PATCH_STATE_LITERAL: {
+                size_t take = std::min(len, (size_t)op_remain);
+                ret = write_out(buf, take);
+                buf += take;
+                len -= take;
+                op_remain -= take;
+                if (op_remain == 0) {
+                    state = PATCH_STATE_OP;
+                }
+                break;
+            }
+
+            case PATCH_STATE_DIFF_DATA: {
+                size_t take = std::min({len, (size_t)op_remain, WORK_BUF_LEN});
+                if (pread(base_fd, work_buf, take, (off_t)op_base_offset) != (ssize_t)take) {
+                    ESP_LOGE(TAG, "Base read failed at %lu", op_base_offset);
+                    ret = ESP_FAIL;
+                    break;
+                }
+
+                for (size_t idx = 0; idx < take; idx += 1) {
+                    work_buf[idx] = (uint8_t)(work_buf[idx] + buf[idx]);
+                }
+
+                ret = write_out(work_buf, take);
+                buf += take;
+                len -= take;
+                op_base_offset += take;
+                op_remain -= take;
+                if (op_remain == 0) {
+                    state = PATCH_STATE_OP;
+                }
+                break;
+            }
+
+            case PATCH_STATE_DONE: {
+                ESP_LOGE(TAG, "Trailing %u bytes after END", len);
+                ret = ESP_ERR_INVALID_SIZE;
+                break;
+            }
+
+            default: {
+                ret = ESP_ERR_INVALID_STATE;
+                break;
+            }
+        }
+    }
+
+    if (ret != ESP_OK) {
+        state = PATCH_STATE_FAILED;
+    }
+
+    return ret;
+}
+
+esp_err_t delta_patcher::finish()
+{
+    if (out_fp == nullptr) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    esp_err_t ret = ESP_OK;
+    uint8_t digest[32] = {};
+    mbedtls_sha256_finish(&sha_ctx, digest);
+    if (state != PATCH_STATE_DONE) {
+        ESP_LOGE(TAG, "Patch incomplete, state=%lu", (uint32_t)state);
+        ret = ESP_ERR_INVALID_STATE;
+    } else if (out_len != target_len) {
+        ESP_LOGE(TAG, "Output length mismatch: %u, expect %u", out_len, target_len);
+        ret = ESP_ERR_INVALID_SIZE;
+    } else if (memcmp(digest, target_sha256, sizeof(digest)) != 0) {
+        ESP_LOGE(TAG, "Output SHA-256 mismatch");
+        ret = ESP_ERR_INVALID_CRC;
+    } else {
+        fflush(out_fp);
+        fsync(fileno(out_fp));
+    }
+
+    close_files();
+
+    // Only a verified image may ever show up at out_path, i.e. the prefetcher serves a cached ".bin" on sight
+    if (ret == ESP_OK) {
+        unlink(out_path);
+        if (rename(tmp_path, out_path) != 0) {
+            ESP_LOGE(TAG, "Failed to rename to %s", out_path);
+            ret = ESP_FAIL;
+        }
+    }
+
+    if (ret == ESP_OK) {
+        ESP_LOGI(TAG, "Patched image OK, %u bytes", out_len);
+    } else {
+        unlink(tmp_path);
+    }
+
+    return ret;
+}
+
+void delta_patcher::abort()
+{
+    bool in_progress = out_fp != nullptr;
+    close_files();
+    if (in_progress) {
+        unlink(tmp_path);
+    }
+
+    state = PATCH_STATE_HEADER;
+    hdr_fill = 0;
+    args_fill = 0;
+    out_len = 0;
+    target_len = 0;
+}
+
+uint32_t delta_patcher::read_le32(const uint8_t *buf)
+{
+    return (uint32_t)buf[0] | ((uint32_t)buf[1] << 8) | ((uint32_t)buf[2] << 16) | ((uint32_t)buf[3] << 24);
+}
+
+esp_err_t delta_patcher::parse_header()
+{
+    if (memcmp(hdr_buf, "SIDP", 4) != 0 || hdr_buf[4] != FORMAT_VERSION) {
+        ESP_LOGE(TAG, "Bad patch header");
+        return ESP_ERR_INVALID_VERSION;
+    }
+
+    if (memcmp(hdr_buf + 8, expect_base_sha256, sizeof(expect_base_sha256)) != 0) {
+        ESP_LOGE(TAG, "Patch is for a different base image");
+        return ESP_ERR_INVALID_CRC;
+    }
+
+    memcpy(target_sha256, hdr_buf + 40, sizeof(target_sha256));
+    target_len = read_le32(hdr_buf + 72);
+    state = PATCH_STATE_OP;
+    return ESP_OK;
+}
+
+esp_err_t delta_patcher::start_op()
+{
+    uint32_t len = 0;
+    if (curr_op == PATCH_OP_ADD) {
+        len = read_le32(args_buf);
+    } else {
+        op_base_offset = read_le32(args_buf);
+        len = read_le32(args_buf + 4);
+        if (op_base_offset > base_len || len > base_len - op_base_offset) {
+            ESP_LOGE(TAG, "Op 0x%02x out of base: off=%lu len=%lu", curr_op, op_base_offset, len);
+            return ESP_ERR_INVALID_SIZE;
+        }
+    }
+
+    if (len > target_len - out_len) {
+        ESP_LOGE(TAG, "Op 0x%02x overruns target: len=%lu at %u/%u", curr_op, len, out_len, target_len);
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    op_remain = len;
+    if (curr_op == PATCH_OP_COPY) {
+        state = PATCH_STATE_OP;
+        return copy_from_base(op_base_offset, len);
+    }
+
+    if (len == 0) {
+        state = PATCH_STATE_OP;
+    } else {
+        state = curr_op == PATCH_OP_ADD ? PATCH_STATE_LITERAL : PATCH_STATE_DIFF_DATA;
+    }
+
+    return ESP_OK;
+}
+
+esp_err_t delta_patcher::copy_from_base(uint32_t offset, uint32_t len)
+{
+    while (len > 0) {
+        size_t take = std::min((size_t)len, WORK_BUF_LEN);
+        if (pread(base_fd, work_buf, take, (off_t)offset) != (ssize_t)take) {
+            ESP_LOGE(TAG, "Base read failed at %lu", offset);
+            return ESP_FAIL;
+        }
+
+        auto ret = write_out(work_buf, take);
+        if (ret != ESP_OK) {
+            return ret;
+        }
+
+        offset += take;
+        len -= take;
+    }
+
+    return ESP_OK;
+}
+
+esp_err_t delta_patcher::write_out(const uint8_t *buf, size_t len)
+{
+    if (len < 1) {
+        return ESP_OK;
+    }
+
+    if (fwrite(buf, len, 1, out_fp) < 1) {
+        ESP_LOGE(TAG, "Output write failed at %u", out_len);
+        return ESP_FAIL;
+    }
+
+    mbedtls_sha256_update(&sha_ctx, buf, len);
+    out_len += len;
+    return ESP_OK;
+}
+
+esp_err_t delta_patcher::hash_base(uint8_t *digest_out)
+{
+    mbedtls_sha256_context base_ctx = {};
+    mbedtls_sha256_init(&base_ctx);
+    mbedtls_sha256_starts(&base_ctx, 0);
+
+    esp_err_t ret = ESP_OK;
+    size_t offset = 0;
+    while (offset < base_len) {
+        size_t take = std::min(base_len - offset, WORK_BUF_LEN);
+        if (pread(base_fd, work_buf, take, (off_t)offset) != (ssize_t)take) {
+            ret = ESP_FAIL;
+            break;
+        }
+
+        mbedtls_sha256_update(&base_ctx, work_buf, take);
+        offset += take;
+    }
+
+    mbedtls_sha256_finish(&base_ctx, digest_out);
+    mbedtls_sha256_free(&base_ctx);
+    return ret;
+}
+
+void delta_patcher::close_files()
+{
+    if (base_fd >= 0) {
+        close(base_fd);
+        base_fd = -1;
+    }
+
+    if (out_fp != nullptr) {
+        fclose(out_fp);
+        out_fp = nullptr;
+    }
+
+    if (sha_started) {
+        mbedtls_sha256_free(&sha_ctx);
+        sha_started = false;
+    }
+}
+
+delta_patcher::~delta_patcher()
+{
+    abort();
+    if (work_buf != nullptr) {
+        heap_caps_free(work_buf);
+        work_buf = nullptr;
+    }
+}
@@ -0,0 +1,100 @@
+#pragma once
+
+#include <cstdio>
+#include <cstdint>
+#include <cstddef>
+#include <esp_err.h>
+#include <mbedtls/sha256.h>
+
+/**
+ * Streaming applier for binary delta patches, rebuilding a new image from a locally stored base image
+ *
+ * @remark Patch format, all little-endian:
+ *         Header (76 bytes): "SIDP" | u8 version (1) | u8[3] reserved | base SHA256[32] | target SHA256[32] | u32 target length
+ *         Then a stream of ops, each led by one op byte:
+ *           0x00 END
+ *           0x01 COPY  u32 base offset | u32 length                       - copy from the base image
+ *           0x02 ADD   u32 length | <length bytes>                        - literal bytes
+ *           0x03 DIFF  u32 base offset | u32 length | <length bytes>      - out = base + byte (mod 256), for shifted code
+ * @remark feed() takes the patch in chunks of any size as they arrive (i.e. bin/fwd blobs), RAM use is one work buffer
+ * @remark Output is written to "<out_path>.tmp" and only renamed to out_path by a successful finish(),
+ *         a failed or aborted patch never leaves anything at out_path
+ * @remark finish() only succeeds when the output length & SHA256 match the target in the header
+ */
+class delta_patcher
+{
+public:
+    static constexpr size_t HEADER_LEN = 76;
+    static constexpr uint8_t FORMAT_VERSION = 1;
+    static constexpr size_t WORK_BUF_LEN = 1024;
+    static constexpr size_t MAX_PATH_LEN = 128;
+
+    enum patch_op : uint8_t {
+        PATCH_OP_END = 0x00,
+        PATCH_OP_COPY = 0x01,
+        PATCH_OP_ADD = 0x02,
+        PATCH_OP_DIFF = 0x03,
+    };
+
+public:
+    delta_patcher() = default;
+    delta_patcher(const delta_patcher &) = delete;
+    delta_patcher &operator=(const delta_patcher &) = delete;
+    ~delta_patcher();
+
+    esp_err_t begin(const char *base_path, const uint8_t *base_sha256, const char *_out_path, bool verify_base = true);
+    esp_err_t feed(const uint8_t *buf, size_t len);
+    esp_err_t finish();
+    void abort();
+
+    [[nodiscard]] size_t get_output_len() const
+    {
+        return out_len;
+    }
+
+private:
+    enum patch_state : uint32_t {
+        PATCH_STATE_HEADER,
+        PATCH_STATE_OP,
+        PATCH_STATE_ARGS,
+        PATCH_STATE_LITERAL,
+        PATCH_STATE_DIFF_DATA,
+        PATCH_STATE_DONE,
+        PATCH_STATE_FAILED,
+    };
+
+    static uint32_t read_le32(const uint8_t *buf);
+    esp_err_t parse_header();
+    esp_err_t start_op();
+    esp_err_t copy_from_base(uint32_t offset, uint32_t len);
+    esp_err_t write_out(const uint8_t *buf, size_t len);
+    esp_err_t hash_base(uint8_t *digest_out);
+    void close_files();
+
+private:
+    int base_fd = -1;
+    size_t base_len = 0;
+    FILE *out_fp = nullptr;
+    char out_path[MAX_PATH_LEN] = {};
+    char tmp_path[MAX_PATH_LEN + 4] = {};
+    uint8_t *work_buf = nullptr;
+    mbedtls_sha256_context sha_ctx = {};
+    bool sha_started = false;
+
+    patch_state state = PATCH_STATE_HEADER;
+    uint8_t expect_base_sha256[32] = {};
+    uint8_t target_sha256[32] = {};
+    size_t target_len = 0;
+    size_t out_len = 0;
+
+    uint8_t hdr_buf[HEADER_LEN] = {};
+    size_t hdr_fill = 0;
+    uint8_t curr_op = PATCH_OP_END;
+    uint8_t args_buf[8] = {};
+    size_t args_need = 0;
+    size_t args_fill = 0;
+    uint32_t op_base_offset = 0;
+    uint32_t op_remain = 0;
+
+    static const constexpr char TAG[] = "delta_patch";
+};
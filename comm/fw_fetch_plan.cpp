@@ -0,0 +1,160 @@
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <unistd.h>
+#include <esp_log.h>
+#include <esp_heap_caps.h>
+#include "fw_fetch_plan.hpp"
+
+esp_err_t fw_fetch_plan::begin(const rpc::cmd::fw_manifest_cmd *manifest, image_fanout *_fanout, const image_prefetcher *cache, const char *_patch_out_path)
+{
+    if (manifest == nullptr || _fanout == nullptr || manifest->fw_len < 1) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    // Not abort(): the caller already began the new image in the fanout, only our own state goes
+    if (delta) {
+        patcher.abort();
+    }
+
+    fanout = _fanout;
+    delta = false;
+    blob_offset = 0;
+    image_len = manifest->fw_len;
+    blob_len = manifest->fw_len;
+
+    char base_path[image_prefetcher::MAX_PATH_LEN] = {};
+    bool base_cached = manifest->has_delta && manifest->delta_len > 0 && cache != nullptr && _patch_out_path != nullptr
+                       && cache->get_ready_path(manifest->delta_base_sha256, base_path, sizeof(base_path)) == ESP_OK;
+    if (!base_cached) {
+        ESP_LOGI(TAG, "Full image from bin/fw, len=%u", blob_len);
+        return ESP_OK;
+    }
+
+    auto ret = patcher.begin(base_path, manifest->delta_base_sha256, _patch_out_path);
+    if (ret != ESP_OK) {
+        ESP_LOGW(TAG, "Can't patch against %s: 0x%x, falling back to bin/fw", base_path, ret);
+        return ESP_OK;
+    }
+
+    strlcpy(patch_out_path, _patch_out_path, sizeof(patch_out_path));
+    delta = true;
+    blob_len = manifest->delta_len;
+    ESP_LOGI(TAG, "Delta from bin/fwd against %s, len=%u instead of %u", base_path, blob_len, image_len);
+    return ESP_OK;
+}
+
+esp_err_t fw_fetch_plan::on_chunk(const mqtt_client::mq_cmd_pkt *pkt)
+{
+    if (pkt == nullptr) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    if (fanout == nullptr) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    // A late chunk of the other kind (i.e. from before a fallback) is dropped, not mixed into this image
+    if (pkt->type != (delta ? mqtt_client::MQ_CMD_BIN_FW_DELTA : mqtt_client::MQ_CMD_BIN_FW)) {
+        ESP_LOGW(TAG, "Unexpected packet type %u", pkt->type);
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+
+    const uint8_t *buf = pkt->blob != nullptr ? pkt->blob : pkt->buf;
+    size_t len = pkt->payload_len;
+    if (len < 1 || blob_offset + len > blob_len) {
+        ESP_LOGE(TAG, "Chunk overruns blob: off=%lu len=%u, blob len=%u", blob_offset, len, blob_len);
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    auto ret = delta ? patcher.feed(buf, len) : fanout->write_chunk(blob_offset, buf, len);
+    if (ret != ESP_OK) {
+        return ret;
+    }
+
+    blob_offset += len;
+    return ESP_OK;
+}
+
+esp_err_t fw_fetch_plan::finish()
+{
+    if (fanout == nullptr || !is_blob_done()) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    if (!delta) {
+        auto ret = fanout->finish_image();
+        fanout = nullptr;
+        return ret;
+    }
+
+    auto ret = patcher.finish();
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Patch failed: 0x%x", ret);
+    } else if (patcher.get_output_len() != image_len) {
+        ESP_LOGE(TAG, "Patched image len %u, manifest says %u", patcher.get_output_len(), image_len);
+        ret = ESP_ERR_INVALID_SIZE;
+    }
+
+    // The fanout hashes it again against the manifest's SHA-256, so a patch built for another target can't slip through
+    ret = ret ?: replay_into_fanout();
+    unlink(patch_out_path);
+    ret = ret ?: fanout->finish_image();
+    if (ret != ESP_OK) {
+        fanout->abort_image();
+    }
+
+    fanout = nullptr;
+    delta = false;
+    return ret;
+}
+
+void fw_fetch_plan::abort()
+{
+    if (delta) {
+        patcher.abort();
+    }
+
+    if (fanout != nullptr) {
+        fanout->abort_image();
+    }
+
+    fanout = nullptr;
+    delta = false;
+    blob_len = 0;
+    blob_offset = 0;
+    image_len = 0;
+}
+
+esp_err_t fw_fetch_plan::replay_into_fanout()
+{
+    FILE *fp = fopen(patch_out_path, "r");
+    if (fp == nullptr) {
+        ESP_LOGE(TAG, "Failed to open %s", patch_out_path);
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    auto *buf = (uint8_t *)heap_caps_malloc(REPLAY_CHUNK_LEN, MALLOC_CAP_SPIRAM);
+    if (buf == nullptr) {
+        fclose(fp);
+        return ESP_ERR_NO_MEM;
+    }
+
+    esp_err_t ret = ESP_OK;
+    size_t offset = 0;
+    while (offset < image_len && ret == ESP_OK) {
+        size_t read_len = fread(buf, 1, std::min(REPLAY_CHUNK_LEN, image_len - offset), fp);
+        if (read_len < 1) {
+            ESP_LOGE(TAG, "Short read at %u/%u", offset, image_len);
+            ret = ESP_ERR_INVALID_SIZE;
+            break;
+        }
+
+        ret = fanout->write_chunk(offset, buf, read_len);
+        offset += read_len;
+    }
+
+    heap_caps_free(buf);
+    fclose(fp);
+    return ret;
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <esp_err.h>
+#include "mqtt_client.hpp"
+#include "rpc_cmd_packet.hpp"
+#include "image_fanout.hpp"
+#include "image_prefetcher.hpp"
+#include "delta_patcher.hpp"
+
+/**
+ * Picks where a firmware image gets fetched from for a fw_manifest_cmd, and routes the chunks coming back
+ *
+ * @remark With "base" & "dlen" in the manifest and that base image verified in the prefetch cache, the image comes as
+ *         a delta patch from bin/fwd and delta_patcher rebuilds it locally, otherwise it comes as-is from bin/fw
+ * @remark Call image_fanout::begin_image() with the manifest's SHA-256 & length before begin(), either way the image
+ *         ends up in the fanout: bin/fw chunks go straight in, a rebuilt image is replayed into it by finish()
+ * @remark Fetch loop: request_blob(get_blob_type(), get_next_offset(), ...) & hand the MQ_CMD_BIN_FW/MQ_CMD_BIN_FW_DELTA
+ *         packet to on_chunk() until is_blob_done(), then finish() - which fails if the image doesn't verify
+ * @remark A base that's cached but fails delta_patcher's check falls back to bin/fw, rather than failing the job
+ */
+class fw_fetch_plan
+{
+public:
+    static constexpr size_t REPLAY_CHUNK_LEN = 2048;
+
+public:
+    fw_fetch_plan() = default;
+    fw_fetch_plan(const fw_fetch_plan &) = delete;
+    fw_fetch_plan &operator=(const fw_fetch_plan &) = delete;
+
+    esp_err_t begin(const rpc::cmd::fw_manifest_cmd *manifest, image_fanout *_fanout, const image_prefetcher *cache, const char *_patch_out_path);
+    esp_err_t on_chunk(const mqtt_client::mq_cmd_pkt *pkt);
+    esp_err_t finish();
+    void abort();
+
+    [[nodiscard]] bool is_delta() const
+    {
+        return delta;
+    }
+
+    [[nodiscard]] const char *get_blob_type() const
+    {
+        return delta ? mq::TOPIC_CMD_BIN_FIRMWARE_DELTA : mq::TOPIC_CMD_BIN_FIRMWARE;
+    }
+
+    [[nodiscard]] size_t get_blob_len() const
+    {
+        return blob_len;
+    }
+
+    [[nodiscard]] uint32_t get_next_offset() const
+    {
+        return blob_offset;
+    }
+
+    [[nodiscard]] bool is_blob_done() const
+    {
+        return blob_len > 0 && blob_offset >= blob_len;
+    }
+
+private:
+    esp_err_t replay_into_fanout();
+
+private:
+    image_fanout *fanout = nullptr;
+    delta_patcher patcher = {};
+    bool delta = false;
+    size_t blob_len = 0;
+    uint32_t blob_offset = 0;
+    size_t image_len = 0;
+    char patch_out_path[delta_patcher::MAX_PATH_LEN] = {};
+
+    static const constexpr char TAG[] = "fw_fetch";
+};
@@ -1,4 +1,6 @@
 #include <cstdio>
+#include <algorithm>
+#include <cstring>
 #include <esp_log.h>
 #include "http_downloader.hpp"
 
@@ -8,6 +10,49 @@ esp_err_t http_downloader::init(const char *_url, const char *_save_path, size_t
         return ESP_ERR_INVALID_ARG;
     }
 
+    auto ret = init_client(_url, _max_len);
+    if (ret != ESP_OK) {
+        return ret;
+    }
+
+    fp = fopen(_save_path, "w+");
+    if (fp == nullptr) {
+        ESP_LOGE(TAG, "Failed to save file");
+        return ESP_ERR_NO_MEM;
+    }
+
+    return ESP_OK;
+}
+
+esp_err_t http_downloader::init(const char *_url, const esp_partition_t *_partition, size_t _max_len, const uint8_t *_sha256)
+{
+    if (_partition == nullptr || _url == nullptr || _max_len > _partition->size) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    auto ret = init_client(_url, _max_len == 0 ? _partition->size : _max_len);
+    if (ret != ESP_OK) {
+        return ret;
+    }
+
+    // A re-init writes from the start of the partition again, nothing of the previous image counts as written or erased
+    partition = _partition;
+    curr_pos = 0;
+    erased_len = 0;
+    sha_mismatch = false;
+    reset_hash();
+    if (_sha256 != nullptr) {
+        memcpy(expected_sha256, _sha256, sizeof(expected_sha256));
+        mbedtls_sha256_init(&sha_ctx);
+        mbedtls_sha256_starts(&sha_ctx, 0);
+        sha_started = true;
+    }
+
+    return ESP_OK;
+}
+
+esp_err_t http_downloader::init_client(const char *_url, size_t _max_len)
+{
     esp_http_client_config_t config = {};
     config.url = _url;
     config.disable_auto_redirect = false;
@@ -18,6 +63,7 @@ esp_err_t http_downloader::init(const char *_url, const char *_save_path, size_t
     config.timeout_ms = 600000; // In case I'm in China...
     config.buffer_size = DEFAULT_HTTP_BUF_SIZE;
     config.buffer_size_tx = DEFAULT_HTTP_BUF_SIZE;
+    config.is_async = async_mode;
 
     evt_group = xEventGroupCreate();
     if (evt_group == nullptr) {
@@ -32,16 +78,79 @@ esp_err_t http_downloader::init(const char *_url, const char *_save_path, size_t
     }
 
     max_len = _max_len;
-    fp = fopen(_save_path, "w+");
-    if (fp == nullptr) {
-        ESP_LOGE(TAG, "Failed to save file");
-        return ESP_ERR_NO_MEM;
+    return ESP_OK;
+}
+
+esp_err_t http_downloader::write_sink(const void *buf, size_t len)
+{
+    if (partition == nullptr) {
+        if (fp == nullptr) {
+            ESP_LOGE(TAG, "Invalid file pointer");
+            return ESP_ERR_INVALID_STATE;
+        }
+
+        size_t ret = fwrite(buf, len, 1, fp);
+        if (ret < 1) {
+            ESP_LOGE(TAG, "Something wrong when saving file, ret=%d", ret);
+            return ESP_ERR_INVALID_STATE;
+        }
+
+        return ESP_OK;
     }
 
+    // Erase only what the next write needs, a short image then doesn't pay for erasing the whole partition
+    size_t end_pos = curr_pos + len;
+    if (end_pos > erased_len) {
+        size_t erase_end = std::min((size_t)partition->size, (end_pos + partition->erase_size - 1) / partition->erase_size * partition->erase_size);
+        auto ret = esp_partition_erase_range(partition, erased_len, erase_end - erased_len);
+        if (ret != ESP_OK) {
+            ESP_LOGE(TAG, "Failed to erase %s @ 0x%x: 0x%x", partition->label, erased_len, ret);
+            return ret;
+        }
+
+        erased_len = erase_end;
+    }
+
+    auto ret = esp_partition_write(partition, curr_pos, buf, len);
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to write %s @ 0x%x: 0x%x", partition->label, curr_pos, ret);
+        return ret;
+    }
+
+    if (sha_started) {
+        mbedtls_sha256_update(&sha_ctx, (const uint8_t *)buf, len);
+    }
+
+    return ESP_OK;
+}
+
+esp_err_t http_downloader::finish_sink()
+{
+    if (!sha_started) {
+        return ESP_OK;
+    }
+
+    uint8_t digest[32] = {};
+    mbedtls_sha256_finish(&sha_ctx, digest);
+    reset_hash();
+
+    if (memcmp(digest, expected_sha256, sizeof(digest)) != 0) {
+        ESP_LOGE(TAG, "SHA-256 mismatch on %s, len=%u", partition->label, curr_pos);
+        sha_mismatch = true;
+        return ESP_ERR_INVALID_CRC;
+    }
 
     return ESP_OK;
 }
 
+void http_downloader::reset_hash()
+{
+    if (sha_started) {
+        mbedtls_sha256_free(&sha_ctx);
+        sha_started = false;
+    }
+}
+
 esp_err_t http_downloader::set_url(const char *_url)
 {
     return esp_http_client_set_url(client_ctx, _url);
@@ -73,6 +182,10 @@ esp_err_t http_downloader::request(uint32_t timeout_ticks)
     }
 
     EventBits_t bits = xEventGroupWaitBits(evt_group, (http_downloader::REQ_DONE | http_downloader::REQ_ERROR), pdTRUE, pdFALSE, timeout_ticks);
+    if (sha_mismatch) {
+        return ESP_ERR_INVALID_CRC;
+    }
+
     if ((bits & http_downloader::REQ_DONE) == 0) {
         ESP_LOGE(TAG, "Failed to download - timeout!");
         return ESP_ERR_TIMEOUT;
@@ -81,6 +194,31 @@ esp_err_t http_downloader::request(uint32_t timeout_ticks)
     return ret;
 }
 
+esp_err_t http_downloader::request_step()
+{
+    if (!async_mode) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    auto ret = esp_http_client_perform(client_ctx);
+    if (ret != ESP_OK) {
+        return ret; // ESP_ERR_HTTP_EAGAIN while still in progress
+    }
+
+    // ON_FINISH/ERROR fire from within perform(), so the outcome is already in the event group
+    EventBits_t bits = xEventGroupGetBits(evt_group);
+    if (sha_mismatch) {
+        return ESP_ERR_INVALID_CRC;
+    }
+
+    if ((bits & http_downloader::REQ_DONE) == 0) {
+        ESP_LOGE(TAG, "Request ended without finishing");
+        return ESP_FAIL;
+    }
+
+    return ESP_OK;
+}
+
 esp_err_t http_downloader::http_evt_handler(esp_http_client_event_t *evt)
 {
     if (evt == nullptr || evt->user_data == nullptr) {
@@ -89,6 +227,13 @@ esp_err_t http_downloader::http_evt_handler(esp_http_client_event_t *evt)
     }
 
     auto *ctx = (http_downloader *)evt->user_data;
+
+    // In async mode there's more where this came from, have the waiting executor step again right away
+    bool progressed = evt->event_id == HTTP_EVENT_ON_DATA || evt->event_id == HTTP_EVENT_ON_FINISH || evt->event_id == HTTP_EVENT_ERROR;
+    if (progressed && ctx->notify_task != nullptr) {
+        xTaskNotifyGive(ctx->notify_task);
+    }
+
     switch (evt->event_id) {
         case HTTP_EVENT_ERROR: {
             xEventGroupClearBits(ctx->evt_group, (http_downloader::REQ_DATA_AVAIL | http_downloader::REQ_DONE));
@@ -104,23 +249,13 @@ esp_err_t http_downloader::http_evt_handler(esp_http_client_event_t *evt)
                 return ESP_ERR_NO_MEM;
             }
 
-            if (ctx->fp == nullptr) {
-                ESP_LOGE(TAG, "Invalid file pointer");
+            if (ctx->write_sink(evt->data, evt->data_len) != ESP_OK) {
                 xEventGroupClearBits(ctx->evt_group, (http_downloader::REQ_DATA_AVAIL | http_downloader::REQ_DONE));
                 xEventGroupSetBits(ctx->evt_group, http_downloader::REQ_ERROR);
                 return ESP_ERR_INVALID_STATE;
             }
 
-            size_t ret = fwrite(evt->data, evt->data_len, 1, ctx->fp);
-            if (ret < 1) {
-                ESP_LOGE(TAG, "Something wrong when saving file, ret=%d", ret);
-                xEventGroupClearBits(ctx->evt_group, (http_downloader::REQ_DATA_AVAIL | http_downloader::REQ_DONE));
-                xEventGroupSetBits(ctx->evt_group, http_downloader::REQ_ERROR);
-                return ESP_ERR_INVALID_STATE;
-            } else {
-                ctx->curr_pos += evt->data_len;
-            }
-
+            ctx->curr_pos += evt->data_len;
             ESP_LOGI(TAG, "Written %u, pos=%d", evt->data_len, ctx->curr_pos);
             xEventGroupClearBits(ctx->evt_group, http_downloader::REQ_ERROR);
             xEventGroupSetBits(ctx->evt_group, http_downloader::REQ_DATA_AVAIL);
@@ -129,6 +264,18 @@ esp_err_t http_downloader::http_evt_handler(esp_http_client_event_t *evt)
 
         case HTTP_EVENT_ON_FINISH: {
             ESP_LOGI(TAG, "Request finished, flushing fp");
+            if (ctx->partition != nullptr) {
+                if (ctx->finish_sink() != ESP_OK) {
+                    xEventGroupClearBits(ctx->evt_group, (http_downloader::REQ_DATA_AVAIL | http_downloader::REQ_DONE));
+                    xEventGroupSetBits(ctx->evt_group, http_downloader::REQ_ERROR);
+                    return ESP_ERR_INVALID_CRC;
+                }
+
+                xEventGroupClearBits(ctx->evt_group, http_downloader::REQ_ERROR);
+                xEventGroupSetBits(ctx->evt_group, http_downloader::REQ_DONE);
+                break;
+            }
+
             if (ctx->fp == nullptr) {
                 return ESP_OK; // Make it no-op
             }
@@ -176,6 +323,8 @@ http_downloader::~http_downloader()
     }
 
     if (evt_group != nullptr) {
-        free(evt_group);
+        vEventGroupDelete(evt_group);
     }
+
+    reset_hash();
 }
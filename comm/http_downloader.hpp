@@ -3,6 +3,10 @@
 #include <cstdio>
 #include <esp_err.h>
 #include <esp_http_client.h>
+#include <esp_partition.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <mbedtls/sha256.h>
 
 class http_downloader
 {
@@ -16,11 +20,35 @@ public:
 public:
     http_downloader() = default;
     esp_err_t init(const char *_url, const char *_save_path, size_t _max_len = 1048576);
+
+    /**
+     * Download straight into a raw data partition, so the image can be mapped later (see image_mapping)
+     *
+     * @remark Sectors are erased just ahead of the data as it arrives, _max_len of 0 means the whole partition
+     * @remark With _sha256 set, the data is hashed as it's written and a mismatch fails the request with ESP_ERR_INVALID_CRC,
+     *         so a truncated or corrupted image never gets mapped
+     */
+    esp_err_t init(const char *_url, const esp_partition_t *_partition, size_t _max_len = 0, const uint8_t *_sha256 = nullptr);
     esp_err_t set_url(const char *url);
     esp_err_t set_method(esp_http_client_method_t method);
     esp_err_t set_header(const char *key, const char *val);
     esp_err_t set_post_field(uint8_t *buf, size_t len);
     esp_err_t request(uint32_t timeout_ticks = pdMS_TO_TICKS(600000));
+
+    /**
+     * Non-blocking request for coroutines, returns ESP_ERR_HTTP_EAGAIN until done
+     *
+     * @remark Needs set_async(true) before init(), esp_http_client only supports async mode over HTTPS
+     */
+    esp_err_t request_step();
+    void set_async(bool enable) { async_mode = enable; }
+
+    /**
+     * Notify this task (xTaskNotifyGive) when data lands or the request ends, i.e. a coro::executor running request_step()
+     */
+    void set_notify_task(TaskHandle_t task) { notify_task = task; }
+
+    [[nodiscard]] size_t get_downloaded_len() const { return curr_pos; }
     ~http_downloader();
 
 private:
@@ -29,6 +57,18 @@ private:
     size_t curr_pos = 0;
     size_t max_len = 0;
     FILE *fp = nullptr;
+    const esp_partition_t *partition = nullptr;
+    size_t erased_len = 0;
+    uint8_t expected_sha256[32] = {};
+    bool sha_started = false;
+    bool sha_mismatch = false;
+    mbedtls_sha256_context sha_ctx = {};
+    bool async_mode = false;
+    TaskHandle_t notify_task = nullptr;
+    esp_err_t init_client(const char *_url, size_t _max_len);
+    esp_err_t write_sink(const void *buf, size_t len);
+    esp_err_t finish_sink();
+    void reset_hash();
     static esp_err_t http_evt_handler(esp_http_client_event_t *evt);
 
     static const constexpr char TAG[] = "http_dl";
@@ -0,0 +1,309 @@
+#include <cstring>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <esp_log.h>
+#include "image_fanout.hpp"
+
+esp_err_t image_fanout::init()
+{
+    lock = xSemaphoreCreateMutex();
+    evt_group = xEventGroupCreate();
+    if (lock == nullptr || evt_group == nullptr) {
+        ESP_LOGE(TAG, "Failed to create lock/event group");
+        return ESP_ERR_NO_MEM;
+    }
+
+    return ESP_OK;
+}
+
+esp_err_t image_fanout::begin_image(const uint8_t *sha256, const char *path, size_t len)
+{
+    if (sha256 == nullptr || path == nullptr || len < 1) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    xSemaphoreTake(lock, portMAX_DELAY);
+    if (count_active() > 0) {
+        xSemaphoreGive(lock);
+        ESP_LOGE(TAG, "Can't swap image, slots still reading");
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    close_file();
+    fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        xSemaphoreGive(lock);
+        ESP_LOGE(TAG, "Failed to open %s", path);
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    memcpy(image_sha256, sha256, sizeof(image_sha256));
+    image_len = len;
+    fetched_len = 0;
+    verified = false;
+    reset_hash();
+    mbedtls_sha256_init(&sha_ctx);
+    mbedtls_sha256_starts(&sha_ctx, 0);
+    sha_started = true;
+    xEventGroupClearBits(evt_group, FANOUT_DATA_AVAIL | FANOUT_COMPLETE | FANOUT_ABORTED);
+    xSemaphoreGive(lock);
+
+    ESP_LOGI(TAG, "New image, len=%u", len);
+    return ESP_OK;
+}
+
+esp_err_t image_fanout::write_chunk(uint32_t offset, const uint8_t *buf, size_t len)
+{
+    if (buf == nullptr || len < 1) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    xSemaphoreTake(lock, portMAX_DELAY);
+    if (fd < 0 || !sha_started) {
+        xSemaphoreGive(lock);
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    if (offset != fetched_len || offset + len > image_len) {
+        ESP_LOGE(TAG, "Out of order chunk: off=%lu len=%u, expect off=%u", offset, len, fetched_len);
+        xSemaphoreGive(lock);
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    if (pwrite(fd, buf, len, (off_t)offset) != (ssize_t)len) {
+        ESP_LOGE(TAG, "Failed to write chunk at %lu", offset);
+        xSemaphoreGive(lock);
+        return ESP_FAIL;
+    }
+
+    // Chunks are strictly in order, so hashing as they land covers the whole image exactly once
+    mbedtls_sha256_update(&sha_ctx, buf, len);
+    fetched_len = offset + len;
+    xSemaphoreGive(lock);
+
+    // Pulse: set wakes every slot waiting right now, clearing it right away keeps later waits blocking
+    xEventGroupSetBits(evt_group, FANOUT_DATA_AVAIL);
+    xEventGroupClearBits(evt_group, FANOUT_DATA_AVAIL);
+    return ESP_OK;
+}
+
+esp_err_t image_fanout::finish_image()
+{
+    xSemaphoreTake(lock, portMAX_DELAY);
+    if (fd < 0 || !sha_started || fetched_len != image_len) {
+        ESP_LOGE(TAG, "Image incomplete: %u/%u", fetched_len, image_len);
+        xSemaphoreGive(lock);
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    uint8_t digest[32] = {};
+    mbedtls_sha256_finish(&sha_ctx, digest);
+    reset_hash();
+
+    if (memcmp(digest, image_sha256, sizeof(digest)) != 0) {
+        xSemaphoreGive(lock);
+        ESP_LOGE(TAG, "Image SHA-256 mismatch, aborting all slots");
+        xEventGroupSetBits(evt_group, FANOUT_ABORTED);
+        return ESP_ERR_INVALID_CRC;
+    }
+
+    fsync(fd);
+    verified = true;
+    xSemaphoreGive(lock);
+
+    xEventGroupSetBits(evt_group, FANOUT_COMPLETE);
+    return ESP_OK;
+}
+
+void image_fanout::abort_image()
+{
+    xSemaphoreTake(lock, portMAX_DELAY);
+    verified = false;
+    reset_hash();
+    xSemaphoreGive(lock);
+
+    xEventGroupSetBits(evt_group, FANOUT_ABORTED);
+}
+
+bool image_fanout::is_image(const uint8_t *sha256) const
+{
+    if (sha256 == nullptr) {
+        return false;
+    }
+
+    xSemaphoreTake(lock, portMAX_DELAY);
+    bool match = fd >= 0 && verified && memcmp(sha256, image_sha256, sizeof(image_sha256)) == 0;
+    xSemaphoreGive(lock);
+    return match;
+}
+
+esp_err_t image_fanout::open_session(uint8_t slot)
+{
+    if (slot >= mq::MAX_SLOTS) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    xSemaphoreTake(lock, portMAX_DELAY);
+    sessions[slot].active = true;
+    sessions[slot].cursor = 0;
+    xSemaphoreGive(lock);
+    return ESP_OK;
+}
+
+esp_err_t image_fanout::seek(uint8_t slot, uint32_t offset)
+{
+    if (slot >= mq::MAX_SLOTS) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    xSemaphoreTake(lock, portMAX_DELAY);
+    if (!sessions[slot].active || offset > image_len) {
+        xSemaphoreGive(lock);
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    sessions[slot].cursor = offset;
+    xSemaphoreGive(lock);
+    return ESP_OK;
+}
+
+esp_err_t image_fanout::read(uint8_t slot, uint8_t *buf_out, size_t len, size_t *read_len, uint32_t timeout_ticks)
+{
+    if (slot >= mq::MAX_SLOTS || buf_out == nullptr || read_len == nullptr) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    *read_len = 0;
+    xSemaphoreTake(lock, portMAX_DELAY);
+    slot_session &session = sessions[slot];
+    if (!session.active) {
+        xSemaphoreGive(lock);
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    if (session.cursor >= image_len) {
+        xSemaphoreGive(lock);
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    size_t want = std::min(len, image_len - session.cursor);
+    size_t want_end = session.cursor + want;
+    bool landed = is_readable(want_end);
+    xSemaphoreGive(lock);
+
+    TickType_t start_tick = xTaskGetTickCount();
+
+    // Wait for the fetcher to get past the end of what we want, or for verification if that's the last byte
+    while (!landed) {
+        TickType_t elapsed = xTaskGetTickCount() - start_tick;
+        if (timeout_ticks != portMAX_DELAY && elapsed >= timeout_ticks) {
+            return ESP_ERR_TIMEOUT;
+        }
+
+        TickType_t remain = timeout_ticks == portMAX_DELAY ? portMAX_DELAY : (timeout_ticks - elapsed);
+        // A missed pulse only costs us until the next chunk, the last one also leaves FANOUT_COMPLETE set
+        EventBits_t bits = xEventGroupWaitBits(evt_group, FANOUT_DATA_AVAIL | FANOUT_COMPLETE | FANOUT_ABORTED, pdFALSE, pdFALSE, remain);
+        if ((bits & FANOUT_ABORTED) != 0) {
+            return ESP_ERR_INVALID_STATE;
+        }
+
+        xSemaphoreTake(lock, portMAX_DELAY);
+        landed = is_readable(want_end);
+        xSemaphoreGive(lock);
+    }
+
+    // Covers data that had landed already when the image got rejected
+    if ((xEventGroupGetBits(evt_group) & FANOUT_ABORTED) != 0) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    xSemaphoreTake(lock, portMAX_DELAY);
+    ssize_t ret = pread(fd, buf_out, want, (off_t)session.cursor);
+    if (ret < 0) {
+        ESP_LOGE(TAG, "Slot %u read failed at %lu", slot, session.cursor);
+        xSemaphoreGive(lock);
+        return ESP_FAIL;
+    }
+
+    session.cursor += ret;
+    xSemaphoreGive(lock);
+
+    *read_len = ret;
+    return ESP_OK;
+}
+
+esp_err_t image_fanout::wait_verified(uint32_t timeout_ticks)
+{
+    EventBits_t bits = xEventGroupWaitBits(evt_group, FANOUT_COMPLETE | FANOUT_ABORTED, pdFALSE, pdFALSE, timeout_ticks);
+    if ((bits & FANOUT_ABORTED) != 0) {
+        return ESP_ERR_INVALID_CRC;
+    }
+
+    return (bits & FANOUT_COMPLETE) != 0 ? ESP_OK : ESP_ERR_TIMEOUT;
+}
+
+void image_fanout::close_session(uint8_t slot)
+{
+    if (slot >= mq::MAX_SLOTS) {
+        return;
+    }
+
+    xSemaphoreTake(lock, portMAX_DELAY);
+    sessions[slot] = {};
+    xSemaphoreGive(lock);
+}
+
+size_t image_fanout::active_sessions() const
+{
+    xSemaphoreTake(lock, portMAX_DELAY);
+    size_t count = count_active();
+    xSemaphoreGive(lock);
+    return count;
+}
+
+size_t image_fanout::count_active() const
+{
+    size_t count = 0;
+    for (const auto &session : sessions) {
+        count += session.active ? 1 : 0;
+    }
+
+    return count;
+}
+
+bool image_fanout::is_readable(size_t want_end) const
+{
+    // Lock held. The tail is held back until finish_image() has checked the hash
+    return want_end < image_len ? fetched_len >= want_end : verified;
+}
+
+void image_fanout::close_file()
+{
+    if (fd >= 0) {
+        close(fd);
+        fd = -1;
+    }
+}
+
+void image_fanout::reset_hash()
+{
+    if (sha_started) {
+        mbedtls_sha256_free(&sha_ctx);
+        sha_started = false;
+    }
+}
+
+image_fanout::~image_fanout()
+{
+    close_file();
+    reset_hash();
+
+    if (lock != nullptr) {
+        vSemaphoreDelete(lock);
+    }
+
+    if (evt_group != nullptr) {
+        vEventGroupDelete(evt_group);
+    }
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <esp_err.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/event_groups.h>
+#include <freertos/semphr.h>
+#include <mbedtls/sha256.h>
+#include "mq_defs.hpp"
+
+/**
+ * One firmware/algo image fetched once, read by every slot of a gang programmer
+ *
+ * @remark The fetcher appends chunks with write_chunk() as they arrive (from bin/fw or HTTP),
+ *         slots don't have to wait for the whole image, read() blocks only until their range has landed
+ * @remark Each slot has its own session cursor, so slots can run at different speeds
+ * @remark Chunks are hashed as they land, finish_image() fails & aborts every reader on a SHA-256 mismatch,
+ *         and is_image() only matches an image that passed that check
+ * @remark A read() reaching the last byte of the image only returns once the image is verified, so no slot can
+ *         get the whole image before a mismatch is known. Slots writing as they read must still call
+ *         wait_verified() before committing the target (i.e. setting a boot flag or reporting success)
+ */
+class image_fanout
+{
+public:
+    enum evt_bits : uint32_t {
+        FANOUT_DATA_AVAIL = BIT(0),
+        FANOUT_COMPLETE = BIT(1),
+        FANOUT_ABORTED = BIT(2),
+    };
+
+public:
+    image_fanout() = default;
+    ~image_fanout();
+    esp_err_t init();
+    esp_err_t begin_image(const uint8_t *sha256, const char *path, size_t len);
+    esp_err_t write_chunk(uint32_t offset, const uint8_t *buf, size_t len);
+    esp_err_t finish_image();
+    void abort_image();
+    [[nodiscard]] bool is_image(const uint8_t *sha256) const;
+
+public:
+    esp_err_t open_session(uint8_t slot);
+    esp_err_t seek(uint8_t slot, uint32_t offset);
+    esp_err_t read(uint8_t slot, uint8_t *buf_out, size_t len, size_t *read_len, uint32_t timeout_ticks = portMAX_DELAY);
+    esp_err_t wait_verified(uint32_t timeout_ticks = portMAX_DELAY);
+    void close_session(uint8_t slot);
+    [[nodiscard]] size_t active_sessions() const;
+
+private:
+    struct slot_session {
+        bool active;
+        uint32_t cursor;
+    };
+
+    void close_file();
+    void reset_hash();
+    size_t count_active() const;
+    bool is_readable(size_t want_end) const;
+
+private:
+    SemaphoreHandle_t lock = nullptr;
+    EventGroupHandle_t evt_group = nullptr;
+    int fd = -1;
+    uint8_t image_sha256[32] = {};
+    size_t image_len = 0;
+    size_t fetched_len = 0; // Chunks land in order, so everything below this is readable
+    bool verified = false;
+    bool sha_started = false;
+    mbedtls_sha256_context sha_ctx = {};
+    slot_session sessions[mq::MAX_SLOTS] = {}; // Image state & sessions above are all guarded by lock
+
+    static const constexpr char TAG[] = "img_fanout";
+};
@@ -0,0 +1,115 @@
+#include <esp_log.h>
+#include "image_mapping.hpp"
+
+#if CONFIG_IDF_TARGET_LINUX
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#if !CONFIG_IDF_TARGET_LINUX
+esp_err_t image_mapping::map_partition(const esp_partition_t *partition, size_t offset, size_t len)
+{
+    if (partition == nullptr || len < 1 || offset + len > partition->size) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    unmap();
+
+    // esp_partition_mmap() takes care of the MMU page alignment, the pointer we get is already at offset
+    const void *ptr = nullptr;
+    auto ret = esp_partition_mmap(partition, offset, len, ESP_PARTITION_MMAP_DATA, &ptr, &mmap_handle);
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to map %s @ 0x%x len=%u: 0x%x", partition->label, offset, len, ret);
+        return ret;
+    }
+
+    image_base = (const uint8_t *)ptr;
+    image_len = len;
+    return ESP_OK;
+}
+
+esp_err_t image_mapping::map_file(const char *path)
+{
+    ESP_LOGE(TAG, "Can't map files on device, use a partition: %s", path == nullptr ? "" : path);
+    return ESP_ERR_NOT_SUPPORTED;
+}
+#else
+esp_err_t image_mapping::map_file(const char *path)
+{
+    if (path == nullptr) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    unmap();
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        ESP_LOGE(TAG, "Failed to open %s", path);
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    struct stat st = {};
+    if (fstat(fd, &st) != 0 || st.st_size < 1) {
+        close(fd);
+        ESP_LOGE(TAG, "Empty or unreadable image %s", path);
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    void *addr = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd); // The mapping holds its own reference
+    if (addr == MAP_FAILED) {
+        ESP_LOGE(TAG, "Failed to mmap %s", path);
+        return ESP_FAIL;
+    }
+
+    mmap_addr = addr;
+    mmap_len = (size_t)st.st_size;
+    image_base = (const uint8_t *)addr;
+    image_len = mmap_len;
+    return ESP_OK;
+}
+#endif
+
+esp_err_t image_mapping::span(size_t offset, size_t len, const uint8_t **span_out) const
+{
+    if (span_out == nullptr) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    if (image_base == nullptr) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    if (offset > image_len || len > image_len - offset) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    *span_out = image_base + offset;
+    return ESP_OK;
+}
+
+void image_mapping::unmap()
+{
+#if CONFIG_IDF_TARGET_LINUX
+    if (mmap_addr != nullptr) {
+        munmap(mmap_addr, mmap_len);
+        mmap_addr = nullptr;
+        mmap_len = 0;
+    }
+#else
+    if (image_base != nullptr) {
+        esp_partition_munmap(mmap_handle);
+        mmap_handle = 0;
+    }
+#endif
+
+    image_base = nullptr;
+    image_len = 0;
+}
+
+image_mapping::~image_mapping()
+{
+    unmap();
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <esp_err.h>
+#include <sdkconfig.h>
+
+#if !CONFIG_IDF_TARGET_LINUX
+#include <esp_partition.h>
+#endif
+
+/**
+ * Read-only, zero-copy view of a stored firmware/algo image
+ *
+ * @remark On device the image has to live raw in a data partition (see http_downloader's partition sink),
+ *         files on FAT/LittleFS can't be mapped, keep using fread() for those
+ * @remark On the Linux host build, map_file() maps a plain file instead
+ * @remark Spans stay valid until unmap()/destruction, the flash behind them must not be written meanwhile
+ */
+class image_mapping
+{
+public:
+    image_mapping() = default;
+    image_mapping(const image_mapping &) = delete;
+    image_mapping &operator=(const image_mapping &) = delete;
+    ~image_mapping();
+
+#if !CONFIG_IDF_TARGET_LINUX
+    esp_err_t map_partition(const esp_partition_t *partition, size_t offset, size_t len);
+#endif
+    esp_err_t map_file(const char *path);
+    void unmap();
+
+public:
+    esp_err_t span(size_t offset, size_t len, const uint8_t **span_out) const;
+
+    [[nodiscard]] size_t size() const
+    {
+        return image_len;
+    }
+
+    [[nodiscard]] bool mapped() const
+    {
+        return image_base != nullptr;
+    }
+
+private:
+    const uint8_t *image_base = nullptr;
+    size_t image_len = 0;
+#if CONFIG_IDF_TARGET_LINUX
+    void *mmap_addr = nullptr;
+    size_t mmap_len = 0;
+#else
+    esp_partition_mmap_handle_t mmap_handle = 0;
+#endif
+
+    static const constexpr char TAG[] = "img_map";
+};
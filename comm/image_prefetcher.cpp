@@ -0,0 +1,398 @@
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <esp_heap_caps.h>
+#include <mbedtls/sha256.h>
+#include "image_prefetcher.hpp"
+
+esp_err_t image_prefetcher::init(const char *_cache_dir, size_t _bytes_per_sec)
+{
+    if (_cache_dir == nullptr || _bytes_per_sec < 1 || strlen(_cache_dir) >= sizeof(cache_dir)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    strlcpy(cache_dir, _cache_dir, sizeof(cache_dir));
+    bytes_per_sec = _bytes_per_sec;
+
+    evt_group = xEventGroupCreate();
+    job_queue = xQueueCreate(1, sizeof(prefetch_job));
+    job_lock = xSemaphoreCreateMutex();
+    if (evt_group == nullptr || job_queue == nullptr || job_lock == nullptr) {
+        ESP_LOGE(TAG, "Failed to create event group/queue/lock");
+        return ESP_ERR_NO_MEM;
+    }
+
+    // Lowest useful priority, so programming and MQTT always win the CPU
+    if (xTaskCreatePinnedToCore(prefetch_task, "img_prefetch", 6144, this, tskIDLE_PRIORITY + 1, &task_handle, tskNO_AFFINITY) != pdPASS) {
+        ESP_LOGE(TAG, "Failed to create prefetch task");
+        return ESP_ERR_NO_MEM;
+    }
+
+    return ESP_OK;
+}
+
+esp_err_t image_prefetcher::announce(const char *url, const uint8_t *sha256, size_t len)
+{
+    if (url == nullptr || sha256 == nullptr || len < 1 || strlen(url) >= MAX_URL_LEN) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    if (job_queue == nullptr) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    prefetch_job job = {};
+    strlcpy(job.url, url, sizeof(job.url));
+    memcpy(job.sha256, sha256, sizeof(job.sha256));
+    job.len = len;
+
+    // Cancel first: the task clears it when it picks up the next job, so the new one can't get cancelled by mistake
+    xSemaphoreTake(job_lock, portMAX_DELAY);
+    memcpy(announced_sha256, sha256, sizeof(announced_sha256));
+    xEventGroupSetBits(evt_group, PREFETCH_CANCEL);
+    xEventGroupClearBits(evt_group, PREFETCH_READY | PREFETCH_FAILED);
+    xQueueOverwrite(job_queue, &job);
+    xSemaphoreGive(job_lock);
+    return ESP_OK;
+}
+
+void image_prefetcher::hold(bool enable)
+{
+    if (enable) {
+        xEventGroupSetBits(evt_group, PREFETCH_HOLD);
+    } else {
+        xEventGroupClearBits(evt_group, PREFETCH_HOLD);
+    }
+}
+
+void image_prefetcher::set_rate(size_t _bytes_per_sec)
+{
+    bytes_per_sec = std::max((size_t)1, _bytes_per_sec);
+}
+
+esp_err_t image_prefetcher::wait_ready(uint32_t timeout_ticks)
+{
+    EventBits_t bits = xEventGroupWaitBits(evt_group, PREFETCH_READY | PREFETCH_FAILED, pdFALSE, pdFALSE, timeout_ticks);
+    if ((bits & PREFETCH_READY) != 0) {
+        return ESP_OK;
+    }
+
+    return (bits & PREFETCH_FAILED) != 0 ? ESP_FAIL : ESP_ERR_TIMEOUT;
+}
+
+esp_err_t image_prefetcher::get_ready_path(const uint8_t *sha256, char *path_out, size_t path_len) const
+{
+    if (sha256 == nullptr || path_out == nullptr) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    auto ret = make_image_path(path_out, path_len, sha256, "bin");
+    if (ret != ESP_OK) {
+        return ret;
+    }
+
+    return check_cached(sha256, path_out, 0);
+}
+
+void image_prefetcher::prefetch_task(void *_ctx)
+{
+    auto *ctx = (image_prefetcher *)_ctx;
+    prefetch_job job = {};
+
+    while (!ctx->stopping) {
+        if (xQueueReceive(ctx->job_queue, &job, portMAX_DELAY) != pdTRUE) {
+            continue;
+        }
+
+        if (ctx->stopping) {
+            break;
+        }
+
+        // A job that got superseded between dequeue & here is skipped, its replacement is already queued
+        xSemaphoreTake(ctx->job_lock, portMAX_DELAY);
+        bool current = memcmp(job.sha256, ctx->announced_sha256, sizeof(job.sha256)) == 0;
+        if (current) {
+            xEventGroupClearBits(ctx->evt_group, PREFETCH_CANCEL);
+        }
+        xSemaphoreGive(ctx->job_lock);
+
+        if (!current) {
+            continue;
+        }
+
+        auto ret = ctx->fetch(&job);
+
+        // Only report on the image still announced, an older one finishing late must not look like the new one
+        xSemaphoreTake(ctx->job_lock, portMAX_DELAY);
+        if (memcmp(job.sha256, ctx->announced_sha256, sizeof(job.sha256)) == 0) {
+            if (ret == ESP_OK) {
+                xEventGroupSetBits(ctx->evt_group, PREFETCH_READY);
+            } else if ((xEventGroupGetBits(ctx->evt_group) & PREFETCH_CANCEL) == 0) {
+                // Still cancelled means the same image got announced again, the queued copy reports instead
+                ESP_LOGE(TAG, "Prefetch failed: 0x%x %s", ret, esp_err_to_name(ret));
+                xEventGroupSetBits(ctx->evt_group, PREFETCH_FAILED);
+            }
+        }
+        xSemaphoreGive(ctx->job_lock);
+    }
+
+    // Last touch of ctx, the destructor may free it right after this
+    ctx->exited = true;
+    vTaskDelete(nullptr);
+}
+
+esp_err_t image_prefetcher::fetch(const prefetch_job *job)
+{
+    char part_path[MAX_PATH_LEN] = {};
+    char final_path[MAX_PATH_LEN] = {};
+    auto ret = make_image_path(part_path, sizeof(part_path), job->sha256, "part");
+    ret = ret ?: make_image_path(final_path, sizeof(final_path), job->sha256, "bin");
+    if (ret != ESP_OK) {
+        return ret;
+    }
+
+    if (check_cached(job->sha256, final_path, job->len) == ESP_OK) {
+        ESP_LOGI(TAG, "Already cached: %s", final_path);
+        return ESP_OK;
+    }
+
+    esp_http_client_config_t config = {};
+    config.url = job->url;
+    config.user_agent = "SoulInjector/5.0";
+    config.method = HTTP_METHOD_GET;
+    config.timeout_ms = 30000;
+    config.buffer_size = DEFAULT_HTTP_BUF_SIZE;
+    config.buffer_size_tx = DEFAULT_HTTP_BUF_SIZE;
+
+    esp_http_client_handle_t client = esp_http_client_init(&config);
+    if (client == nullptr) {
+        ESP_LOGE(TAG, "Failed to set up ESP http client");
+        return ESP_ERR_NO_MEM;
+    }
+
+    FILE *fp = fopen(part_path, "w");
+    if (fp == nullptr) {
+        esp_http_client_cleanup(client);
+        ESP_LOGE(TAG, "Failed to open %s", part_path);
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    uint8_t digest[32] = {};
+    ret = stream_to_file(client, fp, job, digest);
+    fclose(fp);
+    esp_http_client_close(client);
+    esp_http_client_cleanup(client);
+
+    if (ret == ESP_OK && memcmp(digest, job->sha256, sizeof(digest)) != 0) {
+        ESP_LOGE(TAG, "SHA-256 mismatch, dropping %s", part_path);
+        ret = ESP_ERR_INVALID_CRC;
+    }
+
+    if (ret != ESP_OK) {
+        unlink(part_path);
+        return ret;
+    }
+
+    // Name is only a hash prefix, so drop whatever is there before its digest gets replaced - a crash in between leaves a miss
+    unlink(final_path);
+    ret = write_digest(job->sha256);
+    if (ret != ESP_OK) {
+        unlink(part_path);
+        return ret;
+    }
+
+    if (rename(part_path, final_path) != 0) {
+        ESP_LOGE(TAG, "Failed to rename to %s", final_path);
+        unlink(part_path);
+        return ESP_FAIL;
+    }
+
+    ESP_LOGI(TAG, "Prefetched %u bytes to %s", job->len, final_path);
+    return ESP_OK;
+}
+
+esp_err_t image_prefetcher::stream_to_file(esp_http_client_handle_t client, FILE *fp, const prefetch_job *job, uint8_t *digest_out)
+{
+    auto ret = esp_http_client_open(client, 0);
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to open connection: 0x%x", ret);
+        return ret;
+    }
+
+    int64_t content_len = esp_http_client_fetch_headers(client);
+    int status = esp_http_client_get_status_code(client);
+    if (status != 200 || (content_len > 0 && (size_t)content_len != job->len)) {
+        ESP_LOGE(TAG, "Unexpected response: status=%d len=%lld, expect len=%u", status, content_len, job->len);
+        return ESP_ERR_INVALID_RESPONSE;
+    }
+
+    auto *buf = (uint8_t *)heap_caps_malloc(READ_CHUNK_LEN, MALLOC_CAP_SPIRAM);
+    if (buf == nullptr) {
+        return ESP_ERR_NO_MEM;
+    }
+
+    mbedtls_sha256_context sha_ctx = {};
+    mbedtls_sha256_init(&sha_ctx);
+    mbedtls_sha256_starts(&sha_ctx, 0);
+
+    size_t fetched_len = 0;
+    int64_t start_us = esp_timer_get_time();
+    while (fetched_len < job->len) {
+        throttle(fetched_len, &start_us);
+        if (stopping || (xEventGroupGetBits(evt_group) & PREFETCH_CANCEL) != 0) {
+            ESP_LOGW(TAG, "Prefetch stopped or superseded at %u/%u", fetched_len, job->len);
+            ret = ESP_ERR_INVALID_STATE;
+            break;
+        }
+
+        int read_len = esp_http_client_read(client, (char *)buf, (int)std::min(READ_CHUNK_LEN, job->len - fetched_len));
+        if (read_len <= 0) {
+            ESP_LOGE(TAG, "Read failed at %u/%u: %d", fetched_len, job->len, read_len);
+            ret = ESP_ERR_INVALID_SIZE;
+            break;
+        }
+
+        if (fwrite(buf, read_len, 1, fp) < 1) {
+            ESP_LOGE(TAG, "Failed to write at %u", fetched_len);
+            ret = ESP_FAIL;
+            break;
+        }
+
+        mbedtls_sha256_update(&sha_ctx, buf, read_len);
+        fetched_len += read_len;
+    }
+
+    mbedtls_sha256_finish(&sha_ctx, digest_out);
+    mbedtls_sha256_free(&sha_ctx);
+    heap_caps_free(buf);
+
+    if (ret == ESP_OK) {
+        fflush(fp);
+        fsync(fileno(fp));
+    }
+
+    return ret;
+}
+
+void image_prefetcher::throttle(size_t fetched_len, int64_t *start_us)
+{
+    // While held, the pause must not count as saved-up budget, or we'd burst right after resuming
+    if ((xEventGroupGetBits(evt_group) & PREFETCH_HOLD) != 0) {
+        int64_t held_at = esp_timer_get_time();
+        while (!stopping && (xEventGroupGetBits(evt_group) & (PREFETCH_HOLD | PREFETCH_CANCEL)) == PREFETCH_HOLD) {
+            vTaskDelay(pdMS_TO_TICKS(100));
+        }
+
+        *start_us += esp_timer_get_time() - held_at;
+    }
+
+    int64_t budget_us = (int64_t)fetched_len * 1000000LL / (int64_t)bytes_per_sec;
+    int64_t spent_us = esp_timer_get_time() - *start_us;
+    if (spent_us < budget_us) {
+        vTaskDelay(pdMS_TO_TICKS((budget_us - spent_us) / 1000) + 1);
+    }
+}
+
+esp_err_t image_prefetcher::make_image_path(char *path_out, size_t path_len, const uint8_t *sha256, const char *ext) const
+{
+    char hex[NAME_HEX_LEN + 1] = {};
+    for (size_t idx = 0; idx < NAME_HEX_LEN / 2; idx += 1) {
+        snprintf(hex + idx * 2, 3, "%02x", sha256[idx]);
+    }
+
+    int len = snprintf(path_out, path_len, "%s/%s.%s", cache_dir, hex, ext);
+    if (len < 0 || (size_t)len >= path_len) {
+        ESP_LOGE(TAG, "Image path too long");
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    return ESP_OK;
+}
+
+esp_err_t image_prefetcher::check_cached(const uint8_t *sha256, const char *final_path, size_t expect_len) const
+{
+    struct stat st = {};
+    if (stat(final_path, &st) != 0 || (expect_len > 0 && (size_t)st.st_size != expect_len)) {
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    char sha_path[MAX_PATH_LEN] = {};
+    auto ret = make_image_path(sha_path, sizeof(sha_path), sha256, "sha");
+    if (ret != ESP_OK) {
+        return ret;
+    }
+
+    FILE *fp = fopen(sha_path, "r");
+    if (fp == nullptr) {
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    uint8_t stored[32] = {};
+    size_t read_cnt = fread(stored, sizeof(stored), 1, fp);
+    fclose(fp);
+    if (read_cnt < 1 || memcmp(stored, sha256, sizeof(stored)) != 0) {
+        ESP_LOGW(TAG, "%s holds another image", final_path);
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    return ESP_OK;
+}
+
+esp_err_t image_prefetcher::write_digest(const uint8_t *sha256) const
+{
+    char sha_path[MAX_PATH_LEN] = {};
+    auto ret = make_image_path(sha_path, sizeof(sha_path), sha256, "sha");
+    if (ret != ESP_OK) {
+        return ret;
+    }
+
+    FILE *fp = fopen(sha_path, "w");
+    if (fp == nullptr) {
+        ESP_LOGE(TAG, "Failed to open %s", sha_path);
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    bool written = fwrite(sha256, 32, 1, fp) == 1;
+    fflush(fp);
+    fsync(fileno(fp));
+    fclose(fp);
+    if (!written) {
+        ESP_LOGE(TAG, "Failed to write %s", sha_path);
+        unlink(sha_path);
+        return ESP_FAIL;
+    }
+
+    return ESP_OK;
+}
+
+image_prefetcher::~image_prefetcher()
+{
+    // Let a running download bail out at the next chunk & close its file/client, then wake an idle task with a dummy job
+    if (task_handle != nullptr) {
+        stopping = true;
+        xEventGroupSetBits(evt_group, PREFETCH_CANCEL);
+        prefetch_job wake = {};
+        xQueueOverwrite(job_queue, &wake);
+        while (!exited) {
+            vTaskDelay(pdMS_TO_TICKS(10));
+        }
+
+        task_handle = nullptr;
+    }
+
+    if (job_queue != nullptr) {
+        vQueueDelete(job_queue);
+    }
+
+    if (evt_group != nullptr) {
+        vEventGroupDelete(evt_group);
+    }
+
+    if (job_lock != nullptr) {
+        vSemaphoreDelete(job_lock);
+    }
+}
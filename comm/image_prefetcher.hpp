@@ -0,0 +1,79 @@
+#pragma once
+
+#include <cstdio>
+#include <cstdint>
+#include <cstddef>
+#include <esp_err.h>
+#include <esp_http_client.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/event_groups.h>
+#include <freertos/queue.h>
+#include <freertos/semphr.h>
+
+/**
+ * Fetches an announced upcoming image in the background, while the current job keeps running
+ *
+ * @remark The download runs on a low priority task and is rate-limited, hold() pauses it outright
+ *         for latency sensitive work (i.e. live blob transfers)
+ * @remark Images are content-addressed as "<cache_dir>/<first 16 hex of sha256>.bin", staged as ".part" and only renamed into
+ *         place after the length & SHA-256 check - a path from get_ready_path() never points at a partial image,
+ *         switching over is just opening the new path
+ * @remark The names stay short enough for SPIFFS (32 chars incl. path) & LittleFS, the full SHA-256 sits next to the image
+ *         in "<16 hex>.sha" and every lookup checks it, so a prefix collision reads as a cache miss rather than the wrong image
+ * @remark A newer announce() replaces a pending or running one, READY/FAILED only ever describe the latest announced image
+ * @remark The destructor stops the task cooperatively, a running download is abandoned at the next chunk and cleaned up
+ */
+class image_prefetcher
+{
+public:
+    enum evt_bits : uint32_t {
+        PREFETCH_HOLD = BIT(0),
+        PREFETCH_CANCEL = BIT(1),
+        PREFETCH_READY = BIT(2),
+        PREFETCH_FAILED = BIT(3),
+    };
+
+    static constexpr size_t MAX_URL_LEN = 256;
+    static constexpr size_t MAX_PATH_LEN = 128;
+    static constexpr size_t DEFAULT_BYTES_PER_SEC = 32768;
+    static constexpr size_t READ_CHUNK_LEN = 2048;
+    static constexpr size_t NAME_HEX_LEN = 16;
+
+public:
+    image_prefetcher() = default;
+    ~image_prefetcher();
+    esp_err_t init(const char *_cache_dir, size_t _bytes_per_sec = DEFAULT_BYTES_PER_SEC);
+    esp_err_t announce(const char *url, const uint8_t *sha256, size_t len);
+    void hold(bool enable);
+    void set_rate(size_t _bytes_per_sec);
+    esp_err_t wait_ready(uint32_t timeout_ticks = portMAX_DELAY);
+    esp_err_t get_ready_path(const uint8_t *sha256, char *path_out, size_t path_len) const;
+
+private:
+    struct prefetch_job {
+        char url[MAX_URL_LEN];
+        uint8_t sha256[32];
+        size_t len;
+    };
+
+    static void prefetch_task(void *_ctx);
+    esp_err_t fetch(const prefetch_job *job);
+    esp_err_t stream_to_file(esp_http_client_handle_t client, FILE *fp, const prefetch_job *job, uint8_t *digest_out);
+    void throttle(size_t fetched_len, int64_t *start_us);
+    esp_err_t make_image_path(char *path_out, size_t path_len, const uint8_t *sha256, const char *ext) const;
+    esp_err_t check_cached(const uint8_t *sha256, const char *final_path, size_t expect_len) const;
+    esp_err_t write_digest(const uint8_t *sha256) const;
+
+private:
+    EventGroupHandle_t evt_group = nullptr;
+    SemaphoreHandle_t job_lock = nullptr; // Ties READY/FAILED to announced_sha256
+    uint8_t announced_sha256[32] = {};
+    QueueHandle_t job_queue = nullptr;
+    TaskHandle_t task_handle = nullptr;
+    char cache_dir[MAX_PATH_LEN] = {};
+    volatile size_t bytes_per_sec = DEFAULT_BYTES_PER_SEC;
+    volatile bool stopping = false;
+    volatile bool exited = false;
+
+    static const constexpr char TAG[] = "img_prefetch";
+};
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <cstdint>
+
 #define static_char static const constexpr char
 
 namespace mq
@@ -11,17 +13,39 @@ namespace mq
     static_char TOPIC_REPORT_PROG[] = "prog";
     static_char TOPIC_REPORT_SELF_TEST[] = "test/int";
     static_char TOPIC_REPORT_EXTN_TEST[] = "test/ext";
+    static_char TOPIC_REPORT_POWER_TEST[] = "test/power";
     static_char TOPIC_REPORT_ERASE[] = "erase";
     static_char TOPIC_REPORT_REPAIR[] = "repair";
     static_char TOPIC_REPORT_DISPOSE[] = "dispose";
+    static_char TOPIC_REPORT_READ_MEM[] = "mem";
+    /**
+     * Blob chunk request, a QoS0 rpc::report::blob_req_event {type, off, len} on "<report base>/<MAC>/blob"
+     *
+     * @remark The backend answers on "<cmd base>/<MAC>/<type>/<off>/<len>", i.e. ".../bin/fw/4096/1024",
+     *         which the bin/# subscription already covers
+     * @remark Since WIRE_VERSION 2. Version 1 hosts asked by subscribing to that answer topic instead,
+     *         the backend tells them apart by "ver" in the init report
+     */
+    static_char TOPIC_REPORT_BLOB_REQ[] = "blob";
+
+    static_char TOPIC_SLOT[] = "slot"; // "<base>/<MAC>/slot/<n>/<sub>" addresses one target of a gang programmer
+
+    static constexpr uint8_t SLOT_NONE = 0xff; // Host-wide, or the only target on a single-target host
+    static constexpr uint8_t MAX_SLOTS = 8;
+
+    // Wire version & flags, announced as "ver" in the init report, low 16 bits are the version
+    static constexpr uint32_t WIRE_VERSION = 2; // 2: blob chunks requested on TOPIC_REPORT_BLOB_REQ
+    static constexpr uint32_t WIRE_FLAG_COMPACT = (1U << 16); // Report bodies after init are positional arrays
 
     static_char TOPIC_CMD_BASE[] = "/soulinjector/v1/cmd";
     static_char TOPIC_CMD_METADATA_FIRMWARE[] = "meta/fw";
     static_char TOPIC_CMD_METADATA_FLASH_ALGO[] = "meta/algo";
     static_char TOPIC_CMD_BIN_FIRMWARE[] = "bin/fw";
     static_char TOPIC_CMD_BIN_FLASH_ALGO[] = "bin/algo";
+    static_char TOPIC_CMD_BIN_FIRMWARE_DELTA[] = "bin/fwd"; // Delta patch against a cached base image, see delta_patcher
     static_char TOPIC_CMD_SET_STATE[] = "state";
     static_char TOPIC_CMD_READ_MEM[] = "read_mem";
+    static_char TOPIC_CMD_REPORT_RESP[] = "resp";
 
     enum state : uint32_t {
         MQ_STATE_PING = 0,
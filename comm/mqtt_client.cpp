@@ -4,6 +4,8 @@
 #include <esp_http_client.h>
 #include <esp_mac.h>
 #include <esp_flash.h>
+#include <esp_timer.h>
+#include <esp_random.h>
 #include "rpc_report_packet.hpp"
 #include "rpc_cmd_packet.hpp"
 #include "mq_defs.hpp"
@@ -11,6 +13,8 @@
 esp_err_t mqtt_client::init(esp_mqtt_client_config_t *_mqtt_cfg)
 {
     memcpy(&mqtt_cfg, _mqtt_cfg, sizeof(esp_mqtt_client_config_t));
+    mqtt_cfg.session.disable_clean_session = true; // Persistent session, so reconnects don't need to resubscribe
+    mqtt_cfg.network.disable_auto_reconnect = true; // reconnect_scheduler decides when, see reconnect_timer_cb()
     mqtt_handle = esp_mqtt_client_init(&mqtt_cfg);
     if (mqtt_handle != nullptr) {
         return ESP_FAIL;
@@ -28,15 +32,87 @@ esp_err_t mqtt_client::init(esp_mqtt_client_config_t *_mqtt_cfg)
         return ret;
     }
 
-    cmd_queue = xQueueCreateWithCaps(32, sizeof(mq_cmd_pkt), MALLOC_CAP_SPIRAM);
-    if (cmd_queue == nullptr) {
+    cmd_lanes[MQ_LANE_CONTROL].queue = xQueueCreateWithCaps(CMD_CONTROL_LANE_DEPTH, sizeof(mq_cmd_pkt), MALLOC_CAP_SPIRAM);
+    cmd_lanes[MQ_LANE_CONTROL].policy = CMD_CONTROL_LANE_POLICY;
+    cmd_lanes[MQ_LANE_BULK].queue = xQueueCreateWithCaps(CMD_BULK_LANE_DEPTH, sizeof(mq_cmd_pkt), MALLOC_CAP_SPIRAM);
+    cmd_lanes[MQ_LANE_BULK].policy = CMD_BULK_LANE_POLICY;
+    cmd_avail = xSemaphoreCreateBinary();
+    if (cmd_lanes[MQ_LANE_CONTROL].queue == nullptr || cmd_lanes[MQ_LANE_BULK].queue == nullptr || cmd_avail == nullptr) {
         ESP_LOGE(TAG, "Failed to create cmd queue");
         return ESP_ERR_NO_MEM;
     }
 
+    pub_window = xSemaphoreCreateCounting(PUB_WINDOW_SIZE, PUB_WINDOW_SIZE);
+    pub_drain_lock = xSemaphoreCreateMutex();
+    if (pub_window == nullptr || pub_drain_lock == nullptr) {
+        ESP_LOGE(TAG, "Failed to create publish window");
+        return ESP_ERR_NO_MEM;
+    }
+
+    ident_lock = xSemaphoreCreateMutex();
+    if (ident_lock == nullptr) {
+        ESP_LOGE(TAG, "Failed to create ident event lock");
+        return ESP_ERR_NO_MEM;
+    }
+
+    for (auto &inflight_id : pub_inflight_ids) {
+        inflight_id = -1;
+    }
+
+    for (auto &early_id : pub_early_acks) {
+        early_id = -1;
+    }
+
+    ret = tracker.init();
+    if (ret != ESP_OK) {
+        return ret;
+    }
+
+    reconnect.seed(esp_random());
+    reconnect_timer = xTimerCreate("mq_reconn", 1, pdFALSE, this, reconnect_timer_cb);
+    settle_timer = xTimerCreate("mq_settle", 1, pdFALSE, this, settle_timer_cb);
+    if (reconnect_timer == nullptr || settle_timer == nullptr) {
+        ESP_LOGE(TAG, "Failed to create reconnect timers");
+        return ESP_ERR_NO_MEM;
+    }
+
+#ifdef CONFIG_MQTT_PROTOCOL_5
+    pub_prop_lock = xSemaphoreCreateMutex();
+    if (pub_prop_lock == nullptr) {
+        ESP_LOGE(TAG, "Failed to create publish property lock");
+        return ESP_ERR_NO_MEM;
+    }
+#endif
+
     return esp_mqtt_client_register_event(mqtt_handle, MQTT_EVENT_ANY, mq_event_handler, this);;
 }
 
+esp_err_t mqtt_client::enable_spool(const char *spool_path, size_t max_size)
+{
+    if (spool_enabled) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    auto ret = spool.init(spool_path, max_size);
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to init spool: 0x%x", ret);
+        return ret;
+    }
+
+    if (xTaskCreatePinnedToCore(spool_replay_task, "mq_spool", 4096, this, tskIDLE_PRIORITY + 1, &spool_task_handle, tskNO_AFFINITY) != pdPASS) {
+        ESP_LOGE(TAG, "Failed to create spool replay task");
+        return ESP_ERR_NO_MEM;
+    }
+
+    spool_enabled = true;
+    return ESP_OK;
+}
+
+void mqtt_client::set_compact_wire(bool enable)
+{
+    compact_wire = enable;
+}
+
 esp_err_t mqtt_client::connect()
 {
     if (mqtt_state != nullptr) {
@@ -46,12 +122,70 @@ esp_err_t mqtt_client::connect()
     return esp_mqtt_client_start(mqtt_handle);
 }
 
+esp_err_t mqtt_client::wait_settled(uint32_t timeout_ticks)
+{
+    EventBits_t bits = xEventGroupWaitBits(mqtt_state, MQ_STATE_REGISTERED | MQ_STATE_SETTLED, pdFALSE, pdTRUE, timeout_ticks);
+    return (bits & (MQ_STATE_REGISTERED | MQ_STATE_SETTLED)) == (MQ_STATE_REGISTERED | MQ_STATE_SETTLED) ? ESP_OK : ESP_ERR_TIMEOUT;
+}
+
+void mqtt_client::set_reconnect_seed(uint32_t seed)
+{
+    reconnect.seed(seed);
+}
+
+void mqtt_client::reconnect_timer_cb(TimerHandle_t timer)
+{
+    auto *ctx = (mqtt_client *)pvTimerGetTimerID(timer);
+    if (ctx == nullptr || (xEventGroupGetBits(ctx->mqtt_state) & MQ_STATE_FORCE_DISCONNECT) != 0) {
+        return;
+    }
+
+    ctx->reconnect.on_attempt(esp_timer_get_time() / 1000);
+    auto ret = esp_mqtt_client_reconnect(ctx->mqtt_handle);
+    if (ret != ESP_OK) {
+        // No attempt went out, so no DISCONNECTED will come to re-arm us - count it as failed & back off from here
+        uint32_t delay_ms = ctx->reconnect.on_disconnected(esp_timer_get_time() / 1000);
+        ESP_LOGE(TAG, "Reconnect fail, 0x%x %s, retry in %lu ms", ret, esp_err_to_name(ret), delay_ms);
+        xTimerChangePeriod(timer, pdMS_TO_TICKS(delay_ms) + 1, 0);
+    }
+}
+
+void mqtt_client::settle_timer_cb(TimerHandle_t timer)
+{
+    auto *ctx = (mqtt_client *)pvTimerGetTimerID(timer);
+    if (ctx == nullptr) {
+        return;
+    }
+
+    uint32_t gen = ctx->conn_gen;
+    if ((xEventGroupGetBits(ctx->mqtt_state) & MQ_STATE_REGISTERED) != MQ_STATE_REGISTERED || ctx->settle_gen != gen) {
+        return; // Dropped again before settling, the next connect starts over
+    }
+
+    xEventGroupSetBits(ctx->mqtt_state, MQ_STATE_SETTLED);
+
+    // The link may have dropped between the check & the set, DISCONNECTED has cleared the bits before we set ours
+    if ((xEventGroupGetBits(ctx->mqtt_state) & MQ_STATE_REGISTERED) != MQ_STATE_REGISTERED || ctx->conn_gen != gen) {
+        xEventGroupClearBits(ctx->mqtt_state, MQ_STATE_SETTLED);
+        return;
+    }
+
+    ctx->reconnect.on_settled();
+    if (ctx->spool_task_handle != nullptr) {
+        xTaskNotifyGive(ctx->spool_task_handle);
+    }
+}
+
 esp_err_t mqtt_client::disconnect()
 {
     if (mqtt_state != nullptr) {
         xEventGroupSetBits(mqtt_state, MQ_STATE_FORCE_DISCONNECT);
     }
 
+    if (reconnect_timer != nullptr) {
+        xTimerStop(reconnect_timer, portMAX_DELAY);
+    }
+
     return esp_mqtt_client_disconnect(mqtt_handle);
 }
 
@@ -67,9 +201,9 @@ esp_err_t mqtt_client::report_stuff(rpc::report::base_event *event, const char *
         return ESP_ERR_NO_MEM;
     }
 
-    char topic_full[sizeof(mq::TOPIC_REPORT_BASE) + sizeof(host_sn) + 32] = {};
-    snprintf(topic_full, sizeof(topic_full), "%s/" MACSTR "/%s", mq::TOPIC_REPORT_BASE, MAC2STR(host_sn), event_subtopic);
-    topic_full[sizeof(topic_full) - 1] = '\0';
+    char topic_full[REPORT_TOPIC_MAX_LEN] = {};
+    make_report_topic(topic_full, sizeof(topic_full), event_subtopic, event->slot);
+    event->compact = compact_wire; // init_event ignores it and stays keyed
 
     uint8_t msgpack_buf_stack[256] = {};
     uint8_t *msgpack_buf = nullptr;
@@ -86,8 +220,28 @@ esp_err_t mqtt_client::report_stuff(rpc::report::base_event *event, const char *
         msgpack_buf = msgpack_buf_stack;
     }
 
-    size_t serialised_len = event->serialize(msgpack_buf, sizeof(msgpack_buf));
-    int ret = esp_mqtt_client_enqueue(mqtt_handle, topic_full, (const char *)msgpack_buf, (int)serialised_len, 1, 1, true);
+    size_t serialised_len = event->serialize(msgpack_buf, heap_allocated ? expected_size : sizeof(msgpack_buf_stack));
+    bool registered = (xEventGroupGetBits(mqtt_state) & MQ_STATE_REGISTERED) == MQ_STATE_REGISTERED;
+    int ret = -1;
+    if (registered || !spool_enabled) {
+        ret = enqueue_publish(topic_full, msgpack_buf, serialised_len, 1, true);
+    }
+
+    // Offline or outbox full - park it in the spool rather than losing the record
+    if (ret < 0 && spool_enabled) {
+        auto spool_ret = spool.append(topic_full, msgpack_buf, serialised_len, 1, true);
+        if (heap_allocated) {
+            free(msgpack_buf);
+        }
+
+        if (spool_ret != ESP_OK) {
+            ESP_LOGE(TAG, "record: failed to spool, ret=0x%x", spool_ret);
+            return spool_ret;
+        }
+
+        ESP_LOGW(TAG, "record: spooled %s, %u bytes pending", event_subtopic, spool.pending_bytes());
+        return ESP_OK;
+    }
 
     if (heap_allocated) {
         free(msgpack_buf);
@@ -104,8 +258,24 @@ esp_err_t mqtt_client::report_stuff(rpc::report::base_event *event, const char *
     return ESP_OK;
 }
 
+void mqtt_client::make_report_topic(char *topic_out, size_t topic_len, const char *event_subtopic, uint8_t slot)
+{
+    if (slot == mq::SLOT_NONE) {
+        snprintf(topic_out, topic_len, "%s/" MACSTR "/%s", mq::TOPIC_REPORT_BASE, MAC2STR(host_sn), event_subtopic);
+    } else {
+        snprintf(topic_out, topic_len, "%s/" MACSTR "/%s/%u/%s", mq::TOPIC_REPORT_BASE, MAC2STR(host_sn), mq::TOPIC_SLOT, slot, event_subtopic);
+    }
+
+    topic_out[topic_len - 1] = '\0';
+}
+
 esp_err_t mqtt_client::report_init(rpc::report::init_event *init_evt)
 {
+    if (init_evt == nullptr) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    init_evt->wire_ver = mq::WIRE_VERSION | (compact_wire ? mq::WIRE_FLAG_COMPACT : 0);
     return report_stuff(init_evt, mq::TOPIC_REPORT_INIT);
 }
 
@@ -138,6 +308,16 @@ esp_err_t mqtt_client::report_self_test(rpc::report::self_test_event *test_evt,
     return report_stuff(test_evt, mq::TOPIC_REPORT_SELF_TEST);
 }
 
+esp_err_t mqtt_client::report_power_test(rpc::report::power_test_event *power_evt)
+{
+    return report_stuff(power_evt, mq::TOPIC_REPORT_POWER_TEST);
+}
+
+esp_err_t mqtt_client::report_extn_test(rpc::report::extn_test_event *test_evt)
+{
+    return report_stuff(test_evt, mq::TOPIC_REPORT_EXTN_TEST);
+}
+
 esp_err_t mqtt_client::report_repair(rpc::report::repair_event *repair_evt)
 {
     return report_stuff(repair_evt, mq::TOPIC_REPORT_REPAIR);
@@ -148,6 +328,356 @@ esp_err_t mqtt_client::report_dispose(rpc::report::repair_event *repair_evt)
     return report_stuff(repair_evt, mq::TOPIC_REPORT_DISPOSE);
 }
 
+esp_err_t mqtt_client::send_target_ident_async(const uint8_t *target_sn, size_t sn_len, const uint8_t *fw_sha256, const uint8_t *algo_sha256,
+                                                const report_req_opts *opts, uint32_t *corr_id_out)
+{
+    if (target_sn == nullptr || fw_sha256 == nullptr || algo_sha256 == nullptr || opts == nullptr || corr_id_out == nullptr) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    // One long-lived event, so the hashes are only encoded again when the job changes
+    xSemaphoreTake(ident_lock, portMAX_DELAY);
+    ident_evt.target_sn_len = std::min(sn_len, sizeof(ident_evt.target_sn));
+    memcpy(ident_evt.target_sn, target_sn, ident_evt.target_sn_len);
+    memcpy(ident_evt.firmware_hash, fw_sha256, sizeof(ident_evt.firmware_hash));
+    memcpy(ident_evt.flash_algo_hash, algo_sha256, sizeof(ident_evt.flash_algo_hash));
+
+    auto ret = tracker.begin(opts, &ident_evt.corr_id);
+    if (ret != ESP_OK) {
+        xSemaphoreGive(ident_lock);
+        return ret;
+    }
+
+    ret = report_init(&ident_evt);
+    if (ret != ESP_OK) {
+        tracker.cancel(ident_evt.corr_id);
+    } else {
+        *corr_id_out = ident_evt.corr_id;
+    }
+
+    xSemaphoreGive(ident_lock);
+    return ret;
+}
+
+esp_err_t mqtt_client::send_test_report_async(const uint8_t *payload, size_t len, const report_req_opts *opts, uint32_t *corr_id_out)
+{
+    if (payload == nullptr || opts == nullptr || corr_id_out == nullptr) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    rpc::report::extn_test_event test_evt = {};
+    test_evt.payload = payload;
+    test_evt.payload_len = len;
+
+    auto ret = tracker.begin(opts, &test_evt.corr_id);
+    if (ret != ESP_OK) {
+        return ret;
+    }
+
+    ret = report_extn_test(&test_evt);
+    if (ret != ESP_OK) {
+        tracker.cancel(test_evt.corr_id);
+        return ret;
+    }
+
+    *corr_id_out = test_evt.corr_id;
+    return ESP_OK;
+}
+
+esp_err_t mqtt_client::report_mem_stream(const rpc::cmd::read_mem_cmd *read_cmd, mem_reader_if *reader, uint8_t slot)
+{
+    if (read_cmd == nullptr || reader == nullptr || read_cmd->chunk_len < 1) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    char topic_full[REPORT_TOPIC_MAX_LEN] = {};
+    make_report_topic(topic_full, sizeof(topic_full), mq::TOPIC_REPORT_READ_MEM, slot);
+
+    // Both buffers get reused for every chunk, so RAM use is bounded by chunk_len no matter how much we dump
+    size_t out_buf_len = read_cmd->chunk_len + 64;
+    auto *chunk_buf = (uint8_t *)heap_caps_calloc(1, read_cmd->chunk_len, MALLOC_CAP_SPIRAM);
+    auto *out_buf = (uint8_t *)heap_caps_calloc(1, out_buf_len, MALLOC_CAP_SPIRAM);
+    if (chunk_buf == nullptr || out_buf == nullptr) {
+        ESP_LOGE(TAG, "mem: failed to alloc chunk buffers, len=%lu", read_cmd->chunk_len);
+        free(chunk_buf);
+        free(out_buf);
+        return ESP_ERR_NO_MEM;
+    }
+
+    rpc::report::mem_chunk_event chunk_evt = {};
+    chunk_evt.compact = compact_wire;
+    chunk_evt.req_id = read_cmd->req_id;
+    chunk_evt.total_len = read_cmd->len;
+
+    esp_err_t ret = ESP_OK;
+    uint32_t offset = 0;
+    do {
+        size_t read_len = std::min(read_cmd->len - offset, read_cmd->chunk_len);
+        ret = reader->read_mem(read_cmd->addr + offset, chunk_buf, read_len);
+        if (ret != ESP_OK) {
+            ESP_LOGE(TAG, "mem: read failed at 0x%08lx: 0x%x", read_cmd->addr + offset, ret);
+            break;
+        }
+
+        chunk_evt.addr = read_cmd->addr + offset;
+        chunk_evt.data = chunk_buf;
+        chunk_evt.data_len = read_len;
+        chunk_evt.last = (offset + read_len) >= read_cmd->len;
+
+        size_t serialised_len = chunk_evt.serialize(out_buf, out_buf_len);
+        ret = publish_windowed(topic_full, out_buf, serialised_len);
+        if (ret != ESP_OK) {
+            break;
+        }
+
+        chunk_evt.seq += 1;
+        offset += read_len;
+    } while (offset < read_cmd->len);
+
+    free(chunk_buf);
+    free(out_buf);
+
+    auto drain_ret = wait_window_drained();
+    return ret ?: drain_ret;
+}
+
+int mqtt_client::enqueue_publish(const char *topic, const uint8_t *buf, size_t len, int qos, bool retain)
+{
+#ifdef CONFIG_MQTT_PROTOCOL_5
+    // Aliases only for QoS0. An unacked QoS1 PUBLISH stays in esp-mqtt's outbox and gets resent byte for byte on
+    // the next connection, where an alias-only topic is a protocol error and the broker drops us again, every time.
+    // esp-mqtt has no call to re-topic or drop an outbox entry, and publish properties are client-wide, so the
+    // CONNECTED handler can't re-establish the aliases ahead of the resend without racing publishers either
+    bool connected = (xEventGroupGetBits(mqtt_state) & MQ_STATE_REGISTERED) == MQ_STATE_REGISTERED;
+    if (mqtt_cfg.session.protocol_ver != MQTT_PROTOCOL_V_5 || qos != 0 || !connected) {
+        xSemaphoreTake(pub_prop_lock, portMAX_DELAY);
+        int msg_id = esp_mqtt_client_enqueue(mqtt_handle, topic, (const char *)buf, (int)len, qos, retain, true);
+        xSemaphoreGive(pub_prop_lock);
+        return msg_id;
+    }
+
+    xSemaphoreTake(pub_prop_lock, portMAX_DELAY);
+
+    // Aliases are per network connection, forget what we established on an earlier one
+    uint32_t gen = conn_gen;
+    if (alias_sent_gen != gen) {
+        alias_sent_mask = 0;
+        alias_sent_gen = gen;
+    }
+
+    size_t alias_idx = 0;
+    for (; alias_idx < TOPIC_ALIAS_MAX; alias_idx += 1) {
+        if (alias_topics[alias_idx][0] == '\0') {
+            strlcpy(alias_topics[alias_idx], topic, sizeof(alias_topics[alias_idx]));
+            break;
+        } else if (strcmp(alias_topics[alias_idx], topic) == 0) {
+            break;
+        }
+    }
+
+    esp_mqtt5_publish_property_config_t pub_prop = {};
+    bool aliased = false;
+    if (alias_idx < TOPIC_ALIAS_MAX) {
+        pub_prop.topic_alias = alias_idx + 1;
+        aliased = esp_mqtt5_client_set_publish_property(mqtt_handle, &pub_prop) == ESP_OK; // Fails if the broker allows fewer aliases
+    }
+
+    // First use on this connection sends topic + alias to establish it, after that the alias alone does.
+    // Sent right away rather than enqueued, so an alias-only packet never waits in the outbox for a later connection
+    bool established = aliased && (alias_sent_mask & (1U << alias_idx)) != 0;
+    int msg_id = -1;
+    if (aliased) {
+        msg_id = esp_mqtt_client_publish(mqtt_handle, established ? "" : topic, (const char *)buf, (int)len, qos, retain);
+    } else {
+        msg_id = esp_mqtt_client_enqueue(mqtt_handle, topic, (const char *)buf, (int)len, qos, retain, true);
+    }
+
+    if (aliased && msg_id >= 0) {
+        alias_sent_mask |= (1U << alias_idx);
+    }
+
+    if (aliased) {
+        pub_prop = {};
+        esp_mqtt5_client_set_publish_property(mqtt_handle, &pub_prop);
+    }
+
+    xSemaphoreGive(pub_prop_lock);
+    return msg_id;
+#else
+    return esp_mqtt_client_enqueue(mqtt_handle, topic, (const char *)buf, (int)len, qos, retain, true);
+#endif
+}
+
+esp_err_t mqtt_client::publish_windowed(const char *topic, const uint8_t *buf, size_t len, int qos, bool retain)
+{
+    if (xSemaphoreTake(pub_window, pdMS_TO_TICKS(PUB_WINDOW_TIMEOUT_MS)) != pdTRUE) {
+        ESP_LOGE(TAG, "Publish window stalled");
+        return ESP_ERR_TIMEOUT;
+    }
+
+    // From here until the msg_id is registered, an unmatched PUBACK may be ours, see release_window_slot()
+    taskENTER_CRITICAL(&pub_window_lock);
+    pub_registering += 1;
+    taskEXIT_CRITICAL(&pub_window_lock);
+
+    int msg_id = enqueue_publish(topic, buf, len, qos, retain);
+
+    bool acked = qos == 0; // No PUBACK coming, the slot goes back right away
+    taskENTER_CRITICAL(&pub_window_lock);
+    for (auto &early_id : pub_early_acks) {
+        if (msg_id >= 0 && !acked && early_id == msg_id) {
+            early_id = -1;
+            acked = true;
+            break;
+        }
+    }
+
+    for (size_t idx = 0; msg_id >= 0 && !acked && idx < PUB_WINDOW_SIZE; idx += 1) {
+        if (pub_inflight_ids[idx] < 0) {
+            pub_inflight_ids[idx] = msg_id;
+            break;
+        }
+    }
+
+    pub_registering -= 1;
+    if (pub_registering == 0) {
+        // Nobody is registering any more, so whatever is left there belongs to somebody else
+        for (auto &early_id : pub_early_acks) {
+            early_id = -1;
+        }
+    }
+    taskEXIT_CRITICAL(&pub_window_lock);
+
+    if (msg_id < 0) {
+        xSemaphoreGive(pub_window);
+        ESP_LOGE(TAG, "Windowed publish failed: %d", msg_id);
+        return msg_id == -2 ? ESP_ERR_NO_MEM : ESP_FAIL;
+    }
+
+    if (acked) {
+        xSemaphoreGive(pub_window);
+    }
+
+    return ESP_OK;
+}
+
+void mqtt_client::release_window_slot(int msg_id)
+{
+    bool found = false;
+    taskENTER_CRITICAL(&pub_window_lock);
+    for (auto &inflight_id : pub_inflight_ids) {
+        if (inflight_id >= 0 && inflight_id == msg_id) {
+            inflight_id = -1;
+            found = true;
+            break;
+        }
+    }
+
+    // Only keep it while a windowed publish sits between enqueue & register, otherwise it's a plain QoS1 report's ack
+    if (!found && pub_registering > 0) {
+        pub_early_acks[pub_early_ack_head] = msg_id;
+        pub_early_ack_head = (pub_early_ack_head + 1) % PUB_EARLY_ACK_LEN;
+    }
+    taskEXIT_CRITICAL(&pub_window_lock);
+
+    if (found) {
+        xSemaphoreGive(pub_window);
+    }
+}
+
+esp_err_t mqtt_client::wait_window_drained()
+{
+    if (xSemaphoreTake(pub_drain_lock, pdMS_TO_TICKS(PUB_WINDOW_TIMEOUT_MS)) != pdTRUE) {
+        ESP_LOGE(TAG, "Publish window drain lock timeout");
+        return ESP_ERR_TIMEOUT;
+    }
+
+    size_t taken = 0;
+    for (; taken < PUB_WINDOW_SIZE; taken += 1) {
+        if (xSemaphoreTake(pub_window, pdMS_TO_TICKS(PUB_WINDOW_TIMEOUT_MS)) != pdTRUE) {
+            ESP_LOGE(TAG, "Publish window drain timeout, %u still in flight", PUB_WINDOW_SIZE - taken);
+            break;
+        }
+    }
+
+    for (size_t idx = 0; idx < taken; idx += 1) {
+        xSemaphoreGive(pub_window);
+    }
+
+    xSemaphoreGive(pub_drain_lock);
+    return taken == PUB_WINDOW_SIZE ? ESP_OK : ESP_ERR_TIMEOUT;
+}
+
+void mqtt_client::spool_replay_task(void *_ctx)
+{
+    auto *ctx = (mqtt_client *)_ctx;
+    while (true) {
+        // Kicked on connect, the timeout is only a safety net for missed kicks
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(10000));
+
+        while (!ctx->spool.empty()) {
+            EventBits_t bits = xEventGroupGetBits(ctx->mqtt_state);
+            if ((bits & MQ_STATE_REGISTERED) != MQ_STATE_REGISTERED || (bits & MQ_STATE_SETTLED) == 0) {
+                break;
+            }
+
+            if (ctx->replay_spool_batch() != ESP_OK) {
+                ctx->spool.rewind();
+                vTaskDelay(pdMS_TO_TICKS(1000));
+                break;
+            }
+        }
+    }
+}
+
+esp_err_t mqtt_client::replay_spool_batch()
+{
+    report_spool::record rec = {};
+    size_t batch_bytes = 0;
+    int64_t batch_start = esp_timer_get_time();
+
+    while (batch_bytes < SPOOL_BATCH_BYTES) {
+        auto ret = spool.next(&rec);
+        if (ret == ESP_ERR_NOT_FOUND) {
+            break;
+        } else if (ret != ESP_OK) {
+            return ret;
+        }
+
+        ret = publish_windowed(rec.topic, rec.payload, rec.payload_len, rec.qos, rec.retain);
+        if (ret != ESP_OK) {
+            return ret;
+        }
+
+        batch_bytes += rec.payload_len;
+    }
+
+    auto ret = wait_window_drained();
+    if (ret != ESP_OK) {
+        return ret;
+    }
+
+    ret = spool.commit();
+    ESP_LOGI(TAG, "Spool replayed %u bytes, %u pending", batch_bytes, spool.pending_bytes());
+
+    // Every batch, not only once empty: live appends may keep the spool from ever draining while we replay
+    if (ret == ESP_OK) {
+        auto compact_ret = spool.compact();
+        if (compact_ret != ESP_OK) {
+            ESP_LOGW(TAG, "Spool compaction failed: 0x%x", compact_ret);
+        }
+    }
+
+    // Pace the replay so live reports and blob transfers still get the link
+    int64_t budget_us = (int64_t)batch_bytes * 1000000LL / SPOOL_REPLAY_BYTES_PER_SEC;
+    int64_t spent_us = esp_timer_get_time() - batch_start;
+    if (spent_us < budget_us) {
+        vTaskDelay(pdMS_TO_TICKS((budget_us - spent_us) / 1000) + 1);
+    }
+
+    return ret;
+}
+
 void mqtt_client::mq_event_handler(void *handler_args, esp_event_base_t base, int32_t event_id, void *event_data)
 {
     auto *ctx = (mqtt_client *)handler_args;
@@ -162,26 +692,42 @@ void mqtt_client::mq_event_handler(void *handler_args, esp_event_base_t base, in
             break;
         }
         case MQTT_EVENT_CONNECTED: {
-            if (ctx->subscribe_on_connect() != ESP_OK) {
+            // Topic aliases & the settle timer are per network connection, both compare against this.
+            // No pub_prop_lock here: a publisher may hold it while waiting for esp-mqtt, which is running us right now
+            ctx->conn_gen = ctx->conn_gen + 1;
+
+            // Broker kept our session, so it kept the wildcard subscription too
+            if (mqtt_evt->session_present) {
+                ESP_LOGI(TAG, "Session resumed, skip subscribing");
+            } else if (ctx->subscribe_on_connect() != ESP_OK) {
                 ESP_LOGE(TAG, "Failed to subscribe, disconnect now!");
                 xEventGroupClearBits(ctx->mqtt_state, MQ_STATE_REGISTERED);
                 esp_mqtt_client_disconnect(mqtt_evt->client);
+                break;
             } else {
                 ESP_LOGI(TAG, "Subscribe OK");
-                xEventGroupSetBits(ctx->mqtt_state, MQ_STATE_REGISTERED);
             }
 
+            xEventGroupSetBits(ctx->mqtt_state, MQ_STATE_REGISTERED);
+            ctx->set_blob_request_ready();
+
+            // Spread the backlog replay & init reports, so a fleet coming back together doesn't flood the broker
+            ctx->settle_gen = ctx->conn_gen;
+            uint32_t settle_ms = ctx->reconnect.on_connected(esp_timer_get_time() / 1000);
+            ESP_LOGI(TAG, "Connected, settling for %lu ms", settle_ms);
+            xTimerChangePeriod(ctx->settle_timer, pdMS_TO_TICKS(settle_ms) + 1, portMAX_DELAY);
             break;
         }
 
         case MQTT_EVENT_DISCONNECTED: {
+            // First thing: from here on reports go to the spool, not into esp-mqtt's RAM outbox
+            xEventGroupClearBits(ctx->mqtt_state, MQ_STATE_REGISTERED | MQ_STATE_SETTLED);
             ESP_LOGW(TAG, "MQTT Disconnected!");
+            xTimerStop(ctx->settle_timer, portMAX_DELAY);
             if ((xEventGroupGetBits(ctx->mqtt_state) & MQ_STATE_FORCE_DISCONNECT) == 0) {
-                ESP_LOGI(TAG, "Eagerly reconnecting...");
-                auto ret = esp_mqtt_client_reconnect(ctx->mqtt_handle);
-                if (ret != ESP_OK) {
-                    ESP_LOGE(TAG, "Reconnect fail, 0x%x %s", ret, esp_err_to_name(ret));
-                }
+                uint32_t delay_ms = ctx->reconnect.on_disconnected(esp_timer_get_time() / 1000);
+                ESP_LOGI(TAG, "Reconnecting in %lu ms, failed attempts=%lu", delay_ms, ctx->reconnect.get_failed_attempts());
+                xTimerChangePeriod(ctx->reconnect_timer, pdMS_TO_TICKS(delay_ms) + 1, portMAX_DELAY);
             }
             break;
         }
@@ -193,6 +739,7 @@ void mqtt_client::mq_event_handler(void *handler_args, esp_event_base_t base, in
             break;
         }
         case MQTT_EVENT_PUBLISHED: {
+            ctx->release_window_slot(mqtt_evt->msg_id);
             break;
         }
         case MQTT_EVENT_DATA: {
@@ -200,10 +747,12 @@ void mqtt_client::mq_event_handler(void *handler_args, esp_event_base_t base, in
             break;
         }
         case MQTT_EVENT_BEFORE_CONNECT: {
-            xEventGroupClearBits(ctx->mqtt_state, MQ_STATE_REGISTERED);
+            xEventGroupClearBits(ctx->mqtt_state, MQ_STATE_REGISTERED | MQ_STATE_SETTLED);
             break;
         }
         case MQTT_EVENT_DELETED: {
+            ESP_LOGW(TAG, "Outbox expired msg %d", mqtt_evt->msg_id);
+            ctx->release_window_slot(mqtt_evt->msg_id);
             break;
         }
         default: {
@@ -212,46 +761,41 @@ void mqtt_client::mq_event_handler(void *handler_args, esp_event_base_t base, in
     }
 }
 
-esp_err_t mqtt_client::subscribe_on_connect()
+void mqtt_client::set_blob_request_ready()
 {
-    char topic_str[sizeof(mq::TOPIC_CMD_BASE) + (sizeof(host_sn) * 2) + 16] = {};
-    esp_mqtt_topic_t topics[4] = {};
-
-    snprintf(topic_str, sizeof(topic_str), "%s/" MACSTR "/%s", mq::TOPIC_CMD_BASE, MAC2STR(host_sn), mq::TOPIC_CMD_READ_MEM);
-    topic_str[sizeof(topic_str) - 1] = '\0';
-    topics[0].filter = strdup((const char *)topic_str);
-    topics[0].qos = 2;
-    memset(topic_str, 0, sizeof(topic_str));
-
-    snprintf(topic_str, sizeof(topic_str), "%s/" MACSTR "/%s", mq::TOPIC_CMD_BASE, MAC2STR(host_sn), mq::TOPIC_CMD_SET_STATE);
-    topic_str[sizeof(topic_str) - 1] = '\0';
-    topics[1].filter = strdup((const char *)topic_str);
-    topics[1].qos = 2;
-    memset(topic_str, 0, sizeof(topic_str));
-
-    snprintf(topic_str, sizeof(topic_str), "%s/" MACSTR "/%s", mq::TOPIC_CMD_BASE, MAC2STR(host_sn), mq::TOPIC_CMD_METADATA_FIRMWARE);
-    topic_str[sizeof(topic_str) - 1] = '\0';
-    topics[2].filter = strdup((const char *)topic_str);
-    topics[2].qos = 2;
-    memset(topic_str, 0, sizeof(topic_str));
-
-    snprintf(topic_str, sizeof(topic_str), "%s/" MACSTR "/%s", mq::TOPIC_CMD_BASE, MAC2STR(host_sn), mq::TOPIC_CMD_METADATA_FLASH_ALGO);
-    topic_str[sizeof(topic_str) - 1] = '\0';
-    topics[3].filter = strdup((const char *)topic_str);
-    topics[3].qos = 2;
-    memset(topic_str, 0, sizeof(topic_str));
-
+    xEventGroupSetBits(mqtt_state, MQ_STATE_BIN_REQ_READY);
+    if (notify_task != nullptr) {
+        xTaskNotifyGive(notify_task);
+    }
+}
 
-    auto ret = esp_mqtt_client_subscribe_multiple(mqtt_handle, topics, 4);
-    ESP_LOGI(TAG, "Subscribing to %s, ret=%d", topic_str, ret);
+esp_err_t mqtt_client::subscribe_on_connect()
+{
+    // Control topics at CMD_SUBSCRIBE_QOS, bulk chunks on their own filter at BULK_SUBSCRIBE_QOS, demux happens in decode_cmd_msg()
+    static const struct {
+        const char *sub;
+        int qos;
+    } filters[] = {
+        { "meta/#", CMD_SUBSCRIBE_QOS },
+        { mq::TOPIC_CMD_SET_STATE, CMD_SUBSCRIBE_QOS },
+        { mq::TOPIC_CMD_READ_MEM, CMD_SUBSCRIBE_QOS },
+        { mq::TOPIC_CMD_REPORT_RESP, CMD_SUBSCRIBE_QOS },
+        { "slot/#", CMD_SUBSCRIBE_QOS },
+        { "bin/#", BULK_SUBSCRIBE_QOS },
+    };
 
-    for (size_t idx = 0; idx < 4; idx += 1) {
-        if (topics[idx].filter != nullptr) {
-            free((void *) topics[idx].filter);
-            topics[idx].filter = nullptr;
-        }
+    static constexpr size_t filter_cnt = sizeof(filters) / sizeof(filters[0]);
+    char topic_strs[filter_cnt][sizeof(mq::TOPIC_CMD_BASE) + (sizeof(host_sn) * 3) + 16] = {};
+    esp_mqtt_topic_t topics[filter_cnt] = {};
+    for (size_t idx = 0; idx < filter_cnt; idx += 1) {
+        snprintf(topic_strs[idx], sizeof(topic_strs[idx]), "%s/" MACSTR "/%s", mq::TOPIC_CMD_BASE, MAC2STR(host_sn), filters[idx].sub);
+        topics[idx].filter = topic_strs[idx];
+        topics[idx].qos = filters[idx].qos;
     }
 
+    auto ret = esp_mqtt_client_subscribe_multiple(mqtt_handle, topics, filter_cnt);
+    ESP_LOGI(TAG, "Subscribing to %u filters, ret=%d", filter_cnt, ret);
+
     if (ret < 0) {
         if (ret == -1) {
             ESP_LOGE(TAG, "Failed to subscribe, unknown error");
@@ -268,34 +812,94 @@ esp_err_t mqtt_client::subscribe_on_connect()
     }
 }
 
+esp_err_t mqtt_client::parse_cmd_topic(const char *topic, size_t topic_len, uint8_t *slot_out, const char **sub_out, size_t *sub_len_out)
+{
+    // "<base>/<MAC>/[slot/<n>/]<sub>", MAC is always "xx:xx:xx:xx:xx:xx"
+    static constexpr size_t mac_str_len = 17;
+    size_t base_len = sizeof(mq::TOPIC_CMD_BASE) - 1;
+    if (topic_len <= base_len + 1 + mac_str_len + 1 || strncmp(topic, mq::TOPIC_CMD_BASE, base_len) != 0) {
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+
+    size_t pos = base_len + 1 + mac_str_len + 1;
+    *slot_out = mq::SLOT_NONE;
+
+    size_t slot_seg_len = sizeof(mq::TOPIC_SLOT) - 1;
+    if (topic_len > pos + slot_seg_len + 1 && strncmp(topic + pos, mq::TOPIC_SLOT, slot_seg_len) == 0 && topic[pos + slot_seg_len] == '/') {
+        pos += slot_seg_len + 1;
+        uint32_t slot = 0;
+        size_t digits = 0;
+        while (pos < topic_len && topic[pos] >= '0' && topic[pos] <= '9' && digits < 3) {
+            slot = slot * 10 + (topic[pos] - '0');
+            pos += 1;
+            digits += 1;
+        }
+
+        if (digits == 0 || slot >= mq::MAX_SLOTS || pos >= topic_len || topic[pos] != '/') {
+            ESP_LOGW(TAG, "Invalid slot in cmd topic");
+            return ESP_ERR_INVALID_ARG;
+        }
+
+        *slot_out = (uint8_t)slot;
+        pos += 1;
+    }
+
+    *sub_out = topic + pos;
+    *sub_len_out = topic_len - pos;
+    return ESP_OK;
+}
+
 esp_err_t mqtt_client::decode_cmd_msg(const char *topic, size_t topic_len, uint8_t *buf, size_t buf_len)
 {
     if (topic == nullptr || topic_len < 1) {
         return ESP_ERR_INVALID_ARG;
     }
 
-    // Check if the topic is the command message
-    if (strnstr(topic, mq::TOPIC_CMD_BASE, std::min(sizeof(mq::TOPIC_CMD_BASE), topic_len)) == nullptr) {
-        ESP_LOGW(TAG, "Invalid cmd message: %s", topic);
+    uint8_t slot = mq::SLOT_NONE;
+    const char *sub = nullptr;
+    size_t sub_len = 0;
+    if (parse_cmd_topic(topic, topic_len, &slot, &sub, &sub_len) != ESP_OK) {
+        ESP_LOGW(TAG, "Invalid cmd message: %.*s", (int)topic_len, topic);
         return ESP_ERR_NOT_SUPPORTED;
     }
 
+    // Subtopic must match whole, or be followed by '/' (i.e. "bin/fw/<offset>/<len>")
+    auto sub_is = [sub, sub_len](const char *name, size_t name_size) -> bool {
+        size_t name_len = name_size - 1;
+        return sub_len >= name_len && strncmp(sub, name, name_len) == 0 && (sub_len == name_len || sub[name_len] == '/');
+    };
+
+    // Report responses complete a pending request right here, they never go through the cmd lanes
+    if (sub_is(mq::TOPIC_CMD_REPORT_RESP, sizeof(mq::TOPIC_CMD_REPORT_RESP))) {
+        rpc::cmd::report_resp_cmd resp = {};
+        auto ret = resp.decode(buf, buf_len);
+        if (ret != ESP_OK) {
+            ESP_LOGW(TAG, "Malformed report response");
+            return ret;
+        }
+
+        return tracker.on_report_response(resp.corr_id, resp.code, resp.payload, resp.payload_len);
+    }
+
     // Check topic type & decode accordingly
     mq_cmd_pkt cmd = {};
     esp_err_t ret = ESP_OK;
-    if (strnstr(topic, mq::TOPIC_CMD_METADATA_FIRMWARE, std::min(sizeof(mq::TOPIC_CMD_METADATA_FIRMWARE), topic_len)) != nullptr) {
+    if (sub_is(mq::TOPIC_CMD_METADATA_FIRMWARE, sizeof(mq::TOPIC_CMD_METADATA_FIRMWARE))) {
         ret = make_mq_cmd_packet(&cmd, MQ_CMD_META_FW, buf, buf_len);
-    } else if (strnstr(topic, mq::TOPIC_CMD_METADATA_FLASH_ALGO, std::min(sizeof(mq::TOPIC_CMD_METADATA_FLASH_ALGO), topic_len)) != nullptr) {
+    } else if (sub_is(mq::TOPIC_CMD_METADATA_FLASH_ALGO, sizeof(mq::TOPIC_CMD_METADATA_FLASH_ALGO))) {
         ret = make_mq_cmd_packet(&cmd, MQ_CMD_META_ALGO, buf, buf_len);
-    } else if (strnstr(topic, mq::TOPIC_CMD_BIN_FIRMWARE, std::min(sizeof(mq::TOPIC_CMD_BIN_FIRMWARE), topic_len)) != nullptr) {
-        xEventGroupSetBits(mqtt_state, MQ_STATE_BIN_REQ_READY);
+    } else if (sub_is(mq::TOPIC_CMD_BIN_FIRMWARE, sizeof(mq::TOPIC_CMD_BIN_FIRMWARE))) {
+        set_blob_request_ready();
         ret = make_mq_cmd_packet(&cmd, MQ_CMD_BIN_FW, buf, buf_len);
-    } else if (strnstr(topic, mq::TOPIC_CMD_BIN_FLASH_ALGO, std::min(sizeof(mq::TOPIC_CMD_BIN_FLASH_ALGO), topic_len)) != nullptr) {
-        xEventGroupSetBits(mqtt_state, MQ_STATE_BIN_REQ_READY);
+    } else if (sub_is(mq::TOPIC_CMD_BIN_FIRMWARE_DELTA, sizeof(mq::TOPIC_CMD_BIN_FIRMWARE_DELTA))) {
+        set_blob_request_ready();
+        ret = make_mq_cmd_packet(&cmd, MQ_CMD_BIN_FW_DELTA, buf, buf_len);
+    } else if (sub_is(mq::TOPIC_CMD_BIN_FLASH_ALGO, sizeof(mq::TOPIC_CMD_BIN_FLASH_ALGO))) {
+        set_blob_request_ready();
         ret = make_mq_cmd_packet(&cmd, MQ_CMD_BIN_ALGO, buf, buf_len);
-    } else if (strnstr(topic, mq::TOPIC_CMD_READ_MEM, std::min(sizeof(mq::TOPIC_CMD_READ_MEM), topic_len)) != nullptr) {
+    } else if (sub_is(mq::TOPIC_CMD_READ_MEM, sizeof(mq::TOPIC_CMD_READ_MEM))) {
         ret = make_mq_cmd_packet(&cmd, MQ_CMD_READ_MEM, buf, buf_len);
-    } else if (strnstr(topic, mq::TOPIC_CMD_SET_STATE, std::min(sizeof(mq::TOPIC_CMD_SET_STATE), topic_len)) != nullptr) {
+    } else if (sub_is(mq::TOPIC_CMD_SET_STATE, sizeof(mq::TOPIC_CMD_SET_STATE))) {
         ret = make_mq_cmd_packet(&cmd, MQ_CMD_SET_STATE, buf, buf_len);
     } else {
         ret = ESP_ERR_NOT_SUPPORTED;
@@ -305,11 +909,56 @@ esp_err_t mqtt_client::decode_cmd_msg(const char *topic, size_t topic_len, uint8
         return ret;
     }
 
-    if (xQueueSend(cmd_queue, &cmd, pdMS_TO_TICKS(CONFIG_SI_MQ_RECV_TIMEOUT)) == pdFALSE) {
-        ESP_LOGE(TAG, "CMD queue full!");
-        return ESP_ERR_TIMEOUT;
+    cmd.slot = slot;
+    return push_cmd_packet(&cmd);
+}
+
+esp_err_t mqtt_client::push_cmd_packet(mq_cmd_pkt *cmd)
+{
+    cmd_lane_id lane_id = lane_of(cmd->type);
+    cmd_lane &lane = cmd_lanes[lane_id];
+
+    esp_err_t ret = ESP_OK;
+    switch (lane.policy) {
+        case MQ_LANE_BACKPRESSURE: {
+            if (xQueueSend(lane.queue, cmd, pdMS_TO_TICKS(CONFIG_SI_MQ_RECV_TIMEOUT)) == pdFALSE) {
+                ret = ESP_ERR_TIMEOUT;
+            }
+            break;
+        }
+
+        case MQ_LANE_DROP_NEWEST: {
+            if (xQueueSend(lane.queue, cmd, 0) == pdFALSE) {
+                ret = ESP_ERR_TIMEOUT;
+            }
+            break;
+        }
+
+        case MQ_LANE_DROP_OLDEST: {
+            while (xQueueSend(lane.queue, cmd, 0) == pdFALSE) {
+                mq_cmd_pkt evicted = {};
+                if (xQueueReceive(lane.queue, &evicted, 0) == pdTRUE) {
+                    free_mq_cmd_packet(&evicted);
+                    lane.dropped += 1;
+                }
+            }
+            break;
+        }
+    }
+
+    if (ret != ESP_OK) {
+        lane.dropped += 1;
+        ESP_LOGE(TAG, "CMD lane %lu full! dropped=%lu", lane_id, lane.dropped);
+        free_mq_cmd_packet(cmd);
+        return ret;
+    }
+
+    xSemaphoreGive(cmd_avail);
+    if (notify_task != nullptr) {
+        xTaskNotifyGive(notify_task);
     }
-    return 0;
+
+    return ESP_OK;
 }
 
 esp_err_t mqtt_client::recv_cmd_packet(mqtt_client::mq_cmd_pkt *cmd_pkt, uint32_t timeout_ticks)
@@ -318,18 +967,64 @@ esp_err_t mqtt_client::recv_cmd_packet(mqtt_client::mq_cmd_pkt *cmd_pkt, uint32_
         return ESP_ERR_INVALID_ARG;
     }
 
-    return xQueueReceive(cmd_queue, cmd_pkt, timeout_ticks) == pdTRUE ? ESP_OK : ESP_ERR_TIMEOUT;
+    TickType_t start_tick = xTaskGetTickCount();
+    while (true) {
+        // Strict priority: bulk only gets served when there's no control command waiting
+        for (auto &lane : cmd_lanes) {
+            if (xQueueReceive(lane.queue, cmd_pkt, 0) == pdTRUE) {
+                return ESP_OK;
+            }
+        }
+
+        TickType_t remain = 0;
+        if (timeout_ticks == portMAX_DELAY) {
+            remain = portMAX_DELAY;
+        } else {
+            TickType_t elapsed = xTaskGetTickCount() - start_tick;
+            if (elapsed >= timeout_ticks) {
+                return ESP_ERR_TIMEOUT;
+            }
+
+            remain = timeout_ticks - elapsed;
+        }
+
+        xSemaphoreTake(cmd_avail, remain);
+    }
 }
 
 esp_err_t mqtt_client::request_blob(const char *type, uint32_t offset, size_t expect_blk_len, uint32_t timeout_ticks)
 {
+    if (type == nullptr) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
     if ((xEventGroupWaitBits(mqtt_state, MQ_STATE_BIN_REQ_READY, pdTRUE, pdFALSE, timeout_ticks) & MQ_STATE_BIN_REQ_READY) == 0) {
+        // Previous chunk is presumed lost, let the retry through
+        xEventGroupSetBits(mqtt_state, MQ_STATE_BIN_REQ_READY);
         ESP_LOGE(TAG, "Request blob timeout, try again later");
         return ESP_ERR_TIMEOUT;
     }
 
-    char topic_str[255] = {};
-    snprintf(topic_str, sizeof(topic_str), "%s/" MACSTR "/%s/%lu/%u", mq::TOPIC_CMD_BASE, MAC2STR(host_sn), type, offset, expect_blk_len);
+    // The chunk comes back on cmd/<MAC>/<type>/<offset>/<len>, already covered by bin/#, so just ask for it.
+    // See mq::TOPIC_REPORT_BLOB_REQ, this replaced subscribing to that topic as the request
+    char topic_full[REPORT_TOPIC_MAX_LEN] = {};
+    make_report_topic(topic_full, sizeof(topic_full), mq::TOPIC_REPORT_BLOB_REQ);
 
-    return esp_mqtt_client_subscribe_single(mqtt_handle, topic_str, 1);
+    rpc::report::blob_req_event req_evt = {};
+    req_evt.type = type;
+    req_evt.offset = offset;
+    req_evt.len = expect_blk_len;
+    req_evt.compact = compact_wire;
+
+    uint8_t req_buf[64] = {};
+    size_t req_len = req_evt.serialize(req_buf, sizeof(req_buf));
+    int ret = enqueue_publish(topic_full, req_buf, req_len, BULK_PUBLISH_QOS);
+    if (ret < 0) {
+        // Let the next attempt through rather than waiting on a chunk that was never asked for
+        xEventGroupSetBits(mqtt_state, MQ_STATE_BIN_REQ_READY);
+        ESP_LOGE(TAG, "Failed to request blob: %d", ret);
+        return ret == -2 ? ESP_ERR_NO_MEM : ESP_FAIL;
+    }
+
+    return ESP_OK;
 }
@@ -3,17 +3,42 @@
 #include <freertos/FreeRTOS.h>
 #include <freertos/event_groups.h>
 #include <freertos/queue.h>
+#include <freertos/semphr.h>
+#include <freertos/timers.h>
 #include <esp_err.h>
 #include <multi_heap.h>
 #include <esp_log.h>
+#include "mq_defs.hpp"
 #include "rpc_report_packet.hpp"
+#include "rpc_cmd_packet.hpp"
+#include "report_spool.hpp"
+#include "reporter.hpp"
+#include "report_tracker.hpp"
+#include "reconnect_scheduler.hpp"
 #include "mqtt_client.h"
 
+class mem_reader_if
+{
+public:
+    virtual esp_err_t read_mem(uint32_t addr, uint8_t *buf_out, size_t len) = 0;
+};
 
-class mqtt_client
+class mqtt_client : public async_reporter_if
 {
 private:
     static const constexpr char TAG[] = "si_mqtt";
+    static constexpr size_t REPORT_TOPIC_MAX_LEN = sizeof(mq::TOPIC_REPORT_BASE) + 64; // Base + MAC + slot + subtopic
+    static constexpr int CMD_SUBSCRIBE_QOS = 1; // QoS2's four-way handshake isn't worth it, commands are idempotent anyway
+    static constexpr int BULK_PUBLISH_QOS = 0; // Blob requests, a lost one just times out and gets asked again
+    static constexpr int BULK_SUBSCRIBE_QOS = 0; // bin/# chunks, same as their requests: a lost one gets asked again
+    static constexpr size_t PUB_WINDOW_SIZE = 4;
+    static constexpr uint32_t PUB_WINDOW_TIMEOUT_MS = 30000;
+    static constexpr size_t PUB_EARLY_ACK_LEN = PUB_WINDOW_SIZE * 2;
+    static constexpr size_t CMD_CONTROL_LANE_DEPTH = 16;
+    static constexpr size_t CMD_BULK_LANE_DEPTH = 32;
+    static constexpr size_t SPOOL_BATCH_BYTES = 16384;
+    static constexpr size_t SPOOL_REPLAY_BYTES_PER_SEC = 8192;
+    static constexpr size_t TOPIC_ALIAS_MAX = 8; // QoS0 only (see enqueue_publish()), also capped by the broker's Topic Alias Maximum
 
 public:
     enum mqtt_states : uint32_t {
@@ -22,6 +47,7 @@ public:
         MQ_STATE_SUBSCRIBED = BIT(2),
         MQ_STATE_REGISTERED = (MQ_STATE_CONNECTED | MQ_STATE_SUBSCRIBED),
         MQ_STATE_BIN_REQ_READY = BIT(3),
+        MQ_STATE_SETTLED = BIT(4), // Post-connect pacing done, backlog replay & init reports may go now
     };
 
     enum cmd_type : uint32_t {
@@ -31,10 +57,24 @@ public:
         MQ_CMD_BIN_ALGO,
         MQ_CMD_SET_STATE,
         MQ_CMD_READ_MEM,
+        MQ_CMD_BIN_FW_DELTA,
+    };
+
+    enum cmd_lane_id : uint32_t {
+        MQ_LANE_CONTROL = 0, // Metadata, state & read_mem commands, always served first
+        MQ_LANE_BULK = 1, // bin/fw, bin/fwd & bin/algo chunks
+        MQ_LANE_MAX,
+    };
+
+    enum cmd_lane_policy : uint32_t {
+        MQ_LANE_BACKPRESSURE, // Hold the MQTT task for up to CONFIG_SI_MQ_RECV_TIMEOUT until there's room
+        MQ_LANE_DROP_NEWEST, // Drop the incoming packet right away
+        MQ_LANE_DROP_OLDEST, // Evict the oldest queued packet to make room
     };
 
     struct __attribute__((packed)) mq_cmd_pkt {
         cmd_type type;
+        uint8_t slot; // mq::SLOT_NONE for host-wide commands
         size_t payload_len;
         uint8_t *blob;
         uint8_t buf[128]; // For small buffer, to avoid too much small alloc ops
@@ -47,6 +87,7 @@ public:
         }
 
         pkt_out->type = type;
+        pkt_out->slot = mq::SLOT_NONE;
 
         if (buf == nullptr || buf_len < 1) {
             return ESP_OK;
@@ -58,6 +99,7 @@ public:
                 ESP_LOGE(TAG, "Failed to alloc BLOB in cmd packet, len=%u", buf_len);
                 return ESP_ERR_NO_MEM;
             }
+            memcpy(pkt_out->blob, buf, buf_len);
         } else {
             memcpy(pkt_out->buf, buf, buf_len);
         }
@@ -66,13 +108,52 @@ public:
         return ESP_OK;
     };
 
+    static void free_mq_cmd_packet(mq_cmd_pkt *pkt)
+    {
+        if (pkt != nullptr && pkt->blob != nullptr) {
+            heap_caps_free(pkt->blob);
+            pkt->blob = nullptr;
+        }
+    }
+
+    static cmd_lane_id lane_of(cmd_type type)
+    {
+        return (type == MQ_CMD_BIN_FW || type == MQ_CMD_BIN_FW_DELTA || type == MQ_CMD_BIN_ALGO) ? MQ_LANE_BULK : MQ_LANE_CONTROL;
+    }
+
 public:
     esp_err_t init(esp_mqtt_client_config_t *_mqtt_cfg);
 
+    esp_err_t enable_spool(const char *spool_path, size_t max_size = 1048576);
+
+    /**
+     * Switch report bodies to the compact (positional array) form
+     *
+     * @remark Call before report_init(), the init report always goes keyed and announces the mode in "ver",
+     *         the backend decodes everything after it from this host accordingly
+     * @remark Spooled records keep the form they were made with, MsgPack maps and arrays are told apart by their type byte
+     */
+    void set_compact_wire(bool enable);
+
 public:
     esp_err_t connect();
     esp_err_t disconnect();
 
+    /**
+     * Wait until the link is up and its post-connect pacing is over, call before report_init() after a reconnect
+     */
+    esp_err_t wait_settled(uint32_t timeout_ticks = portMAX_DELAY);
+
+    /**
+     * Fixed seed for the reconnect jitter, for reproducible runs - defaults to a hardware random seed
+     */
+    void set_reconnect_seed(uint32_t seed);
+
+    [[nodiscard]] reconnect_scheduler::link_health get_link_health() const
+    {
+        return reconnect.get_health();
+    }
+
 public:
     esp_err_t report_init(rpc::report::init_event *init_evt);
     esp_err_t report_host_state(rpc::report::state_event *state_evt);
@@ -80,11 +161,33 @@ public:
     esp_err_t report_erase(rpc::report::erase_event *erase_evt);
     esp_err_t report_program(rpc::report::prog_event *prog_evt);
     esp_err_t report_self_test(rpc::report::self_test_event *test_evt, uint8_t *result_payload, size_t payload_len);
+    esp_err_t report_power_test(rpc::report::power_test_event *power_evt);
     esp_err_t report_repair(rpc::report::repair_event *repair_evt);
     esp_err_t report_dispose(rpc::report::repair_event *repair_evt);
+    esp_err_t report_mem_stream(const rpc::cmd::read_mem_cmd *read_cmd, mem_reader_if *reader, uint8_t slot = mq::SLOT_NONE);
+    esp_err_t report_extn_test(rpc::report::extn_test_event *test_evt);
+
+public:
+    esp_err_t send_target_ident_async(const uint8_t *target_sn, size_t sn_len, const uint8_t *fw_sha256, const uint8_t *algo_sha256,
+                                      const report_req_opts *opts, uint32_t *corr_id_out) override;
+    esp_err_t send_test_report_async(const uint8_t *payload, size_t len, const report_req_opts *opts, uint32_t *corr_id_out) override;
     esp_err_t recv_cmd_packet(mq_cmd_pkt *cmd_pkt, uint32_t timeout_ticks = portMAX_DELAY);
     esp_err_t request_blob(const char *type, uint32_t offset, size_t expect_blk_len, uint32_t timeout_ticks = portMAX_DELAY);
 
+    [[nodiscard]] bool is_blob_request_ready() const
+    {
+        return (xEventGroupGetBits(mqtt_state) & MQ_STATE_BIN_REQ_READY) != 0;
+    }
+
+    /**
+     * Also notify this task (xTaskNotifyGive) whenever a command gets queued or a blob request may go out again,
+     * i.e. a coro::executor polling recv_cmd_packet() & is_blob_request_ready()
+     */
+    void set_notify_task(TaskHandle_t task)
+    {
+        notify_task = task;
+    }
+
 public:
     esp_err_t subscribe_on_connect();
 
@@ -92,15 +195,63 @@ private:
     EventGroupHandle_t mqtt_state = nullptr;
     esp_mqtt_client_handle_t mqtt_handle = nullptr;
     esp_mqtt_client_config_t mqtt_cfg = {};
-    QueueHandle_t cmd_queue = nullptr;
+    static constexpr cmd_lane_policy CMD_CONTROL_LANE_POLICY = MQ_LANE_BACKPRESSURE;
+    static constexpr cmd_lane_policy CMD_BULK_LANE_POLICY = MQ_LANE_DROP_NEWEST; // Blob requester retries on timeout anyway
+
+    struct cmd_lane {
+        QueueHandle_t queue;
+        cmd_lane_policy policy;
+        uint32_t dropped;
+    };
+
+    cmd_lane cmd_lanes[MQ_LANE_MAX] = {};
+    SemaphoreHandle_t cmd_avail = nullptr;
+    TaskHandle_t notify_task = nullptr;
     char *request_blob_type = nullptr;
     uint32_t request_blob_offset = 0;
     size_t request_blob_max_len = 0;
     uint8_t host_sn[6] = {};
+    SemaphoreHandle_t pub_window = nullptr;
+    portMUX_TYPE pub_window_lock = portMUX_INITIALIZER_UNLOCKED;
+    SemaphoreHandle_t pub_drain_lock = nullptr; // One drainer at a time, or concurrent drainers each hold part of the window
+    int pub_inflight_ids[PUB_WINDOW_SIZE] = {};
+    int pub_early_acks[PUB_EARLY_ACK_LEN] = {}; // PUBACKs that beat us to registering their msg_id
+    size_t pub_early_ack_head = 0;
+    size_t pub_registering = 0; // Windowed publishes enqueued but not yet in pub_inflight_ids
+    report_spool spool = {};
+    bool spool_enabled = false;
+    TaskHandle_t spool_task_handle = nullptr;
+    report_tracker tracker = {};
+    reconnect_scheduler reconnect{};
+    TimerHandle_t reconnect_timer = nullptr;
+    TimerHandle_t settle_timer = nullptr;
+    volatile uint32_t conn_gen = 0; // Bumped on every CONNECTED
+    volatile uint32_t settle_gen = 0; // Connection the pending settle_timer belongs to
+    rpc::report::init_event ident_evt{};
+    SemaphoreHandle_t ident_lock = nullptr;
+    bool compact_wire = false;
+#ifdef CONFIG_MQTT_PROTOCOL_5
+    SemaphoreHandle_t pub_prop_lock = nullptr; // Publish properties are client-wide in esp-mqtt, so set & enqueue must be atomic
+    char alias_topics[TOPIC_ALIAS_MAX][REPORT_TOPIC_MAX_LEN] = {};
+    uint32_t alias_sent_mask = 0; // Aliases established on connection alias_sent_gen, reset by the first publish after CONNECTED bumps conn_gen
+    uint32_t alias_sent_gen = 0;
+#endif
 
 private:
     static void mq_event_handler(void *handler_args, esp_event_base_t base, int32_t event_id, void *event_data);
     esp_err_t report_stuff(rpc::report::base_event *event, const char *event_subtopic);
+    void make_report_topic(char *topic_out, size_t topic_len, const char *event_subtopic, uint8_t slot = mq::SLOT_NONE);
+    esp_err_t parse_cmd_topic(const char *topic, size_t topic_len, uint8_t *slot_out, const char **sub_out, size_t *sub_len_out);
+    int enqueue_publish(const char *topic, const uint8_t *buf, size_t len, int qos, bool retain = false);
+    esp_err_t publish_windowed(const char *topic, const uint8_t *buf, size_t len, int qos = 1, bool retain = false);
+    void release_window_slot(int msg_id);
+    esp_err_t wait_window_drained();
+    static void spool_replay_task(void *_ctx);
+    static void reconnect_timer_cb(TimerHandle_t timer);
+    static void settle_timer_cb(TimerHandle_t timer);
+    esp_err_t replay_spool_batch();
+    void set_blob_request_ready();
     esp_err_t decode_cmd_msg(const char *topic, size_t topic_len, uint8_t *buf, size_t buf_len);
+    esp_err_t push_cmd_packet(mq_cmd_pkt *cmd);
 
 };
\ No newline at end of file
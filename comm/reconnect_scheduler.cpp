@@ -0,0 +1,70 @@
+#include <algorithm>
+#include "reconnect_scheduler.hpp"
+
+reconnect_scheduler::reconnect_scheduler(uint32_t _base_ms, uint32_t _cap_ms, uint32_t _settle_spread_ms)
+    : base_ms(std::max(_base_ms, (uint32_t)1)), cap_ms(std::max(_cap_ms, _base_ms)), settle_spread_ms(_settle_spread_ms),
+      prev_sleep_ms(base_ms)
+{
+}
+
+void reconnect_scheduler::seed(uint32_t seed_val)
+{
+    rng_state = seed_val != 0 ? seed_val : 0x2545f491; // xorshift gets stuck on 0
+}
+
+uint32_t reconnect_scheduler::on_disconnected(int64_t now_ms)
+{
+    bool was_connected = connected_at_ms >= 0;
+    if (was_connected && now_ms - connected_at_ms >= STABLE_MS) {
+        // It was a healthy link, treat this as a fresh outage
+        prev_sleep_ms = base_ms;
+        failed_attempts = 0;
+    } else {
+        failed_attempts += 1; // Failed attempt, or a link that dropped again too soon
+    }
+
+    connected_at_ms = -1;
+    health = LINK_DOWN;
+
+    uint64_t upper = std::min((uint64_t)cap_ms, (uint64_t)prev_sleep_ms * 3);
+    prev_sleep_ms = std::min(cap_ms, rand_between(base_ms, (uint32_t)upper));
+    return prev_sleep_ms;
+}
+
+void reconnect_scheduler::on_attempt(int64_t now_ms)
+{
+    (void)now_ms;
+    health = LINK_CONNECTING;
+}
+
+uint32_t reconnect_scheduler::on_connected(int64_t now_ms)
+{
+    connected_at_ms = now_ms;
+    health = LINK_SETTLING;
+    return settle_spread_ms > 0 ? rand_between(0, settle_spread_ms) : 0;
+}
+
+void reconnect_scheduler::on_settled()
+{
+    if (health == LINK_SETTLING) {
+        health = LINK_UP;
+    }
+}
+
+uint32_t reconnect_scheduler::next_rand()
+{
+    // xorshift32, plenty for spreading retries and cheap to replay from a seed
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 17;
+    rng_state ^= rng_state << 5;
+    return rng_state;
+}
+
+uint32_t reconnect_scheduler::rand_between(uint32_t low, uint32_t high)
+{
+    if (high <= low) {
+        return low;
+    }
+
+    return low + next_rand() % (high - low + 1);
+}
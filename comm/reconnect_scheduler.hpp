@@ -0,0 +1,70 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+/**
+ * Decides when to reconnect and when to start post-connect work, so a fleet doesn't stampede a restarted broker
+ *
+ * @remark Backoff is "decorrelated jitter": next = min(cap, random(base, prev * 3)), even the first retry is spread
+ * @remark Backoff only resets after the link stayed up for STABLE_MS, a flapping link keeps backing off
+ * @remark No FreeRTOS or clock calls in here, time is passed in and the PRNG is seedable - the same seed and
+ *         timeline always give the same schedule, so many clients can be simulated deterministically
+ */
+class reconnect_scheduler
+{
+public:
+    enum link_health : uint32_t {
+        LINK_DOWN = 0, // Lost, waiting for the backoff to expire
+        LINK_CONNECTING = 1, // Attempt in flight
+        LINK_SETTLING = 2, // Connected, post-connect work still being paced
+        LINK_UP = 3,
+    };
+
+    static constexpr uint32_t DEFAULT_BASE_MS = 1000;
+    static constexpr uint32_t DEFAULT_CAP_MS = 120000;
+    static constexpr uint32_t DEFAULT_SETTLE_SPREAD_MS = 5000;
+    static constexpr int64_t STABLE_MS = 60000;
+
+public:
+    explicit reconnect_scheduler(uint32_t _base_ms = DEFAULT_BASE_MS, uint32_t _cap_ms = DEFAULT_CAP_MS,
+                                 uint32_t _settle_spread_ms = DEFAULT_SETTLE_SPREAD_MS);
+
+    void seed(uint32_t seed_val);
+
+    /**
+     * @return Delay before the next connection attempt, in ms
+     */
+    uint32_t on_disconnected(int64_t now_ms);
+    void on_attempt(int64_t now_ms);
+
+    /**
+     * @return Delay before post-connect work (spool replay, init reports) should start, in ms
+     */
+    uint32_t on_connected(int64_t now_ms);
+    void on_settled();
+
+    [[nodiscard]] link_health get_health() const
+    {
+        return health;
+    }
+
+    [[nodiscard]] uint32_t get_failed_attempts() const
+    {
+        return failed_attempts;
+    }
+
+private:
+    uint32_t next_rand();
+    uint32_t rand_between(uint32_t low, uint32_t high);
+
+private:
+    uint32_t base_ms;
+    uint32_t cap_ms;
+    uint32_t settle_spread_ms;
+    uint32_t rng_state = 0x2545f491;
+    uint32_t prev_sleep_ms;
+    uint32_t failed_attempts = 0;
+    int64_t connected_at_ms = -1;
+    link_health health = LINK_DOWN;
+};
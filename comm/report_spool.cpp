@@ -0,0 +1,354 @@
+#include <cstring>
+#include <algorithm>
+#include <unistd.h>
+#include <esp_log.h>
+#include <esp_heap_caps.h>
+#include <esp_rom_crc.h>
+#include "report_spool.hpp"
+
+esp_err_t report_spool::init(const char *_path, size_t _max_size)
+{
+    if (_path == nullptr || strlen(_path) >= sizeof(path) || _max_size < 1) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    strncpy(path, _path, sizeof(path) - 1);
+    snprintf(idx_path, sizeof(idx_path), "%s.idx", path);
+    max_size = _max_size;
+
+    lock = xSemaphoreCreateMutex();
+    if (lock == nullptr) {
+        ESP_LOGE(TAG, "Failed to create lock");
+        return ESP_ERR_NO_MEM;
+    }
+
+    payload_buf = (uint8_t *)heap_caps_calloc(1, MAX_PAYLOAD_LEN, MALLOC_CAP_SPIRAM);
+    if (payload_buf == nullptr) {
+        ESP_LOGE(TAG, "Failed to alloc payload buffer");
+        return ESP_ERR_NO_MEM;
+    }
+
+    fp = fopen(path, "a+b");
+    if (fp == nullptr) {
+        ESP_LOGE(TAG, "Failed to open spool %s", path);
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    fseek(fp, 0, SEEK_END);
+    tail = ftell(fp);
+
+    auto ret = load_head();
+    if (ret != ESP_OK || head > tail) {
+        head = 0;
+    }
+
+    cursor = head;
+    ESP_LOGI(TAG, "Spool %s opened, %u bytes pending", path, tail - head);
+    return ESP_OK;
+}
+
+esp_err_t report_spool::append(const char *topic, const uint8_t *payload, size_t len, int qos, bool retain)
+{
+    if (topic == nullptr || payload == nullptr || len > MAX_PAYLOAD_LEN || qos < 0 || qos > 2) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    size_t topic_len = strlen(topic);
+    if (topic_len >= MAX_TOPIC_LEN) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    record_hdr hdr = {};
+    hdr.magic = RECORD_MAGIC;
+    hdr.topic_len = topic_len;
+    hdr.flags = FLAG_PRESENT | (uint16_t)qos | (retain ? FLAG_RETAIN : 0);
+    hdr.payload_len = len;
+    hdr.crc = esp_rom_crc32_le(0, (const uint8_t *)topic, topic_len);
+    hdr.crc = esp_rom_crc32_le(hdr.crc, payload, len);
+
+    size_t rec_len = sizeof(hdr) + topic_len + len;
+    xSemaphoreTake(lock, portMAX_DELAY);
+    if (tail + rec_len > max_size) {
+        xSemaphoreGive(lock);
+        ESP_LOGE(TAG, "Spool full, tail=%u", tail);
+        return ESP_ERR_NO_MEM;
+    }
+
+    fseek(fp, 0, SEEK_END);
+    bool ok = fwrite(&hdr, sizeof(hdr), 1, fp) == 1;
+    ok = ok && fwrite(topic, topic_len, 1, fp) == 1;
+    ok = ok && (len == 0 || fwrite(payload, len, 1, fp) == 1);
+    fflush(fp);
+    fsync(fileno(fp));
+
+    if (!ok) {
+        // Drop the torn record, next() would stop at it otherwise
+        ftruncate(fileno(fp), (off_t)tail);
+        xSemaphoreGive(lock);
+        ESP_LOGE(TAG, "Failed to append record");
+        return ESP_FAIL;
+    }
+
+    tail += rec_len;
+    xSemaphoreGive(lock);
+    return ESP_OK;
+}
+
+esp_err_t report_spool::next(record *rec_out)
+{
+    if (rec_out == nullptr) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    xSemaphoreTake(lock, portMAX_DELAY);
+    record_hdr hdr = {};
+    size_t corrupt_at = cursor;
+    size_t skipped = 0;
+    while (cursor < tail && !read_record(cursor, &hdr, rec_out)) {
+        // Torn or corrupt: resync on the next record that checks out, rather than giving up on the rest
+        size_t resync_pos = find_magic(cursor + 1);
+        skipped += resync_pos - cursor;
+        cursor = resync_pos;
+    }
+
+    if (skipped > 0) {
+        ESP_LOGW(TAG, "Corrupted data at %u, skipped %u bytes", corrupt_at, skipped);
+    }
+
+    if (cursor >= tail) {
+        xSemaphoreGive(lock);
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    cursor += sizeof(hdr) + hdr.topic_len + hdr.payload_len;
+    xSemaphoreGive(lock);
+    return ESP_OK;
+}
+
+bool report_spool::read_record(size_t pos, record_hdr *hdr, record *rec_out)
+{
+    fseek(fp, (long)pos, SEEK_SET);
+    if (pos + sizeof(*hdr) > tail || fread(hdr, sizeof(*hdr), 1, fp) != 1 || hdr->magic != RECORD_MAGIC
+        || hdr->topic_len >= MAX_TOPIC_LEN || hdr->payload_len > MAX_PAYLOAD_LEN
+        || pos + sizeof(*hdr) + hdr->topic_len + hdr->payload_len > tail) {
+        return false;
+    }
+
+    uint16_t known_flags = FLAG_PRESENT | FLAG_RETAIN | FLAG_QOS_MASK;
+    if ((hdr->flags & ~known_flags) != 0 || (hdr->flags & FLAG_QOS_MASK) > 2) {
+        return false;
+    }
+
+    memset(rec_out->topic, 0, sizeof(rec_out->topic));
+    bool ok = fread(rec_out->topic, hdr->topic_len, 1, fp) == 1;
+    ok = ok && (hdr->payload_len == 0 || fread(payload_buf, hdr->payload_len, 1, fp) == 1);
+    if (!ok) {
+        return false;
+    }
+
+    uint32_t crc = esp_rom_crc32_le(0, (const uint8_t *)rec_out->topic, hdr->topic_len);
+    crc = esp_rom_crc32_le(crc, payload_buf, hdr->payload_len);
+    if (crc != hdr->crc) {
+        return false;
+    }
+
+    rec_out->payload = payload_buf;
+    rec_out->payload_len = hdr->payload_len;
+    if ((hdr->flags & FLAG_PRESENT) != 0) {
+        rec_out->qos = hdr->flags & FLAG_QOS_MASK;
+        rec_out->retain = (hdr->flags & FLAG_RETAIN) != 0;
+    } else {
+        rec_out->qos = 1;
+        rec_out->retain = false;
+    }
+
+    return true;
+}
+
+size_t report_spool::find_magic(size_t pos)
+{
+    uint8_t scan_buf[256];
+    uint8_t magic[sizeof(RECORD_MAGIC)] = {};
+    memcpy(magic, &RECORD_MAGIC, sizeof(magic));
+
+    while (pos + sizeof(magic) <= tail) {
+        fseek(fp, (long)pos, SEEK_SET);
+        size_t read_len = fread(scan_buf, 1, std::min(sizeof(scan_buf), tail - pos), fp);
+        if (read_len < sizeof(magic)) {
+            break;
+        }
+
+        for (size_t idx = 0; idx + sizeof(magic) <= read_len; idx += 1) {
+            if (memcmp(scan_buf + idx, magic, sizeof(magic)) == 0) {
+                return pos + idx;
+            }
+        }
+
+        pos += read_len - (sizeof(magic) - 1); // Overlap, a magic may straddle two reads
+    }
+
+    return tail;
+}
+
+esp_err_t report_spool::commit()
+{
+    xSemaphoreTake(lock, portMAX_DELAY);
+    head = cursor;
+    auto ret = persist_head();
+    xSemaphoreGive(lock);
+    return ret;
+}
+
+esp_err_t report_spool::rewind()
+{
+    xSemaphoreTake(lock, portMAX_DELAY);
+    cursor = head;
+    xSemaphoreGive(lock);
+    return ESP_OK;
+}
+
+esp_err_t report_spool::compact()
+{
+    xSemaphoreTake(lock, portMAX_DELAY);
+    if (head == 0) {
+        xSemaphoreGive(lock);
+        return ESP_OK;
+    }
+
+    esp_err_t ret = ESP_OK;
+    if (head >= tail) {
+        // All acknowledged, cheapest case
+        if (ftruncate(fileno(fp), 0) != 0) {
+            ret = ESP_FAIL;
+        } else {
+            tail = 0;
+            cursor = 0;
+        }
+    } else if (head > max_size / 2) {
+        // Move the unacknowledged tail to the front, so the file can't creep up to max_size
+        char tmp_path[sizeof(path) + 4] = {};
+        snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+        FILE *tmp_fp = fopen(tmp_path, "wb");
+        if (tmp_fp == nullptr) {
+            xSemaphoreGive(lock);
+            return ESP_ERR_NOT_FOUND;
+        }
+
+        uint8_t copy_buf[512];
+        fseek(fp, (long)head, SEEK_SET);
+        size_t read_len = 0;
+        while ((read_len = fread(copy_buf, 1, sizeof(copy_buf), fp)) > 0) {
+            if (fwrite(copy_buf, 1, read_len, tmp_fp) != read_len) {
+                ret = ESP_FAIL;
+                break;
+            }
+        }
+
+        fflush(tmp_fp);
+        fsync(fileno(tmp_fp));
+        fclose(tmp_fp);
+
+        if (ret == ESP_OK) {
+            // Point the index at the new file first: a crash in between only means replaying some records twice
+            size_t old_head = head;
+            head = 0;
+            persist_head();
+
+            fclose(fp);
+            fp = nullptr;
+            if (rename(tmp_path, path) != 0) {
+                head = old_head;
+                persist_head();
+                ret = ESP_FAIL;
+            }
+
+            fp = fopen(path, "a+b");
+            if (fp == nullptr) {
+                xSemaphoreGive(lock);
+                ESP_LOGE(TAG, "Failed to reopen spool after compaction");
+                return ESP_ERR_INVALID_STATE;
+            }
+
+            if (ret == ESP_OK) {
+                tail -= old_head;
+                cursor -= old_head;
+            }
+        } else {
+            unlink(tmp_path);
+        }
+    } else {
+        xSemaphoreGive(lock);
+        return ESP_OK;
+    }
+
+    if (ret == ESP_OK) {
+        head = 0;
+        ret = persist_head();
+    }
+
+    xSemaphoreGive(lock);
+    ESP_LOGI(TAG, "Compacted, ret=0x%x, %u bytes left", ret, tail);
+    return ret;
+}
+
+bool report_spool::empty()
+{
+    xSemaphoreTake(lock, portMAX_DELAY);
+    bool is_empty = head >= tail;
+    xSemaphoreGive(lock);
+    return is_empty;
+}
+
+size_t report_spool::pending_bytes() const
+{
+    return tail - head;
+}
+
+esp_err_t report_spool::persist_head()
+{
+    FILE *idx_fp = fopen(idx_path, "wb");
+    if (idx_fp == nullptr) {
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    auto head_val = (uint32_t)head;
+    bool ok = fwrite(&head_val, sizeof(head_val), 1, idx_fp) == 1;
+    fflush(idx_fp);
+    fsync(fileno(idx_fp));
+    fclose(idx_fp);
+    return ok ? ESP_OK : ESP_FAIL;
+}
+
+esp_err_t report_spool::load_head()
+{
+    FILE *idx_fp = fopen(idx_path, "rb");
+    if (idx_fp == nullptr) {
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    uint32_t head_val = 0;
+    bool ok = fread(&head_val, sizeof(head_val), 1, idx_fp) == 1;
+    fclose(idx_fp);
+    if (!ok) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    head = head_val;
+    return ESP_OK;
+}
+
+report_spool::~report_spool()
+{
+    if (fp != nullptr) {
+        fflush(fp);
+        fclose(fp);
+    }
+
+    if (payload_buf != nullptr) {
+        free(payload_buf);
+    }
+
+    if (lock != nullptr) {
+        vSemaphoreDelete(lock);
+    }
+}
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <cstdio>
+#include <cstdint>
+#include <esp_err.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+
+/**
+ * Flash-backed append-only spool for report messages that can't go out right now
+ *
+ * @remark Records are appended to a file, the replay cursor is persisted to "<path>.idx" on commit(),
+ *         so anything not acknowledged before a reboot gets replayed again (at-least-once)
+ * @remark Replay reads with next() from the cursor, commit() marks everything read so far as acknowledged,
+ *         rewind() goes back to the last commit after a failed batch
+ * @remark A torn or corrupt record doesn't end the replay: next() scans forward for the next magic whose record
+ *         passes its CRC and carries on from there, logging how many bytes it skipped
+ * @remark Each record keeps the QoS & retain flag it was published with, records from before that replay as QoS1
+ */
+class report_spool
+{
+public:
+    static constexpr size_t MAX_TOPIC_LEN = 96;
+    static constexpr size_t MAX_PAYLOAD_LEN = 4096;
+
+    struct record {
+        char topic[MAX_TOPIC_LEN];
+        const uint8_t *payload;
+        size_t payload_len;
+        int qos;
+        bool retain;
+    };
+
+public:
+    report_spool() = default;
+    ~report_spool();
+    esp_err_t init(const char *_path, size_t _max_size = 1048576);
+    esp_err_t append(const char *topic, const uint8_t *payload, size_t len, int qos = 1, bool retain = false);
+    esp_err_t next(record *rec_out);
+    esp_err_t commit();
+    esp_err_t rewind();
+    esp_err_t compact();
+    bool empty();
+    [[nodiscard]] size_t pending_bytes() const;
+
+private:
+    struct __attribute__((packed)) record_hdr {
+        uint32_t magic;
+        uint16_t topic_len;
+        uint16_t flags;
+        uint32_t payload_len;
+        uint32_t crc;
+    };
+
+    static constexpr uint32_t RECORD_MAGIC = 0x53525053; // "SPRS"
+    static constexpr uint16_t FLAG_QOS_MASK = 0x3;
+    static constexpr uint16_t FLAG_RETAIN = BIT(2);
+    static constexpr uint16_t FLAG_PRESENT = BIT(3); // Unset in records written before the flags existed
+
+    bool read_record(size_t pos, record_hdr *hdr, record *rec_out);
+    size_t find_magic(size_t pos);
+
+    esp_err_t persist_head();
+    esp_err_t load_head();
+
+private:
+    SemaphoreHandle_t lock = nullptr;
+    FILE *fp = nullptr;
+    char path[64] = {};
+    char idx_path[72] = {};
+    size_t max_size = 0;
+    size_t tail = 0; // End of file, where the next append goes
+    size_t head = 0; // First unacknowledged record
+    size_t cursor = 0; // Next record for next()
+    uint8_t *payload_buf = nullptr;
+
+    static const constexpr char TAG[] = "spool";
+};
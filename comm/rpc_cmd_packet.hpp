@@ -2,12 +2,367 @@
 
 #include <cstdint>
 #include <cstddef>
+#include <cstring>
+#include <algorithm>
 #include <esp_err.h>
+#include <esp_heap_caps.h>
+#include <mbedtls/sha256.h>
 
 #include <ArduinoJson.hpp>
 #include <psram_json_allocator.hpp>
 
 namespace rpc::cmd
 {
+    /**
+     * Read memory request, from CMD_READ_MEM
+     *
+     * @remark "id" - Request ID, echoed back in every chunk
+     * @remark "addr" - Beginning address to read from
+     * @remark "len" - Total length to read
+     * @remark "chunk" - Optional chunk length, defaults to DEFAULT_CHUNK_LEN
+     */
+    struct read_mem_cmd
+    {
+    public:
+        static constexpr uint32_t DEFAULT_CHUNK_LEN = 1024;
+        static constexpr uint32_t MAX_CHUNK_LEN = 4096;
 
-}
\ No newline at end of file
+    public:
+        esp_err_t decode(const uint8_t *buf, size_t buf_len)
+        {
+            if (buf == nullptr || buf_len < 1) {
+                return ESP_ERR_INVALID_ARG;
+            }
+
+            PsRamAllocator allocator;
+            ArduinoJson::JsonDocument document(&allocator);
+            if (ArduinoJson::deserializeMsgPack(document, buf, buf_len) != ArduinoJson::DeserializationError::Ok) {
+                return ESP_ERR_INVALID_ARG;
+            }
+
+            if (!document["addr"].is<uint32_t>() || !document["len"].is<uint32_t>()) {
+                return ESP_ERR_INVALID_ARG;
+            }
+
+            req_id = document["id"] | 0U;
+            addr = document["addr"];
+            len = document["len"];
+            if (len > UINT32_MAX - addr) {
+                return ESP_ERR_INVALID_SIZE; // Would wrap past the end of the address space
+            }
+
+            chunk_len = document["chunk"] | DEFAULT_CHUNK_LEN;
+            if (chunk_len < 1 || chunk_len > MAX_CHUNK_LEN) {
+                chunk_len = DEFAULT_CHUNK_LEN;
+            }
+
+            return ESP_OK;
+        }
+
+        uint32_t req_id = 0;
+        uint32_t addr = 0;
+        uint32_t len = 0;
+        uint32_t chunk_len = DEFAULT_CHUNK_LEN;
+    };
+
+    /**
+     * Backend response to an asynchronous report, from CMD_REPORT_RESP
+     *
+     * @remark "cid" - Correlation ID of the report being answered
+     * @remark "code" - Result in esp_err_t, 0 means OK
+     * @remark "pld" - Optional response payload
+     */
+    struct report_resp_cmd
+    {
+    public:
+        esp_err_t decode(const uint8_t *buf, size_t buf_len)
+        {
+            if (buf == nullptr || buf_len < 1) {
+                return ESP_ERR_INVALID_ARG;
+            }
+
+            PsRamAllocator allocator;
+            ArduinoJson::JsonDocument document(&allocator);
+            if (ArduinoJson::deserializeMsgPack(document, buf, buf_len) != ArduinoJson::DeserializationError::Ok) {
+                return ESP_ERR_INVALID_ARG;
+            }
+
+            corr_id = document["cid"] | 0U;
+            if (corr_id == 0) {
+                return ESP_ERR_INVALID_ARG;
+            }
+
+            code = document["code"] | ESP_OK;
+
+            // The document goes away on return, so keep a copy of the payload
+            payload = nullptr;
+            payload_len = 0;
+            auto pld = document["pld"].as<ArduinoJson::MsgPackBinary>();
+            if (pld.data() != nullptr && pld.size() > 0) {
+                payload_len = std::min(pld.size(), sizeof(payload_buf));
+                memcpy(payload_buf, pld.data(), payload_len);
+                payload = payload_buf;
+            }
+
+            return ESP_OK;
+        }
+
+        uint32_t corr_id = 0;
+        esp_err_t code = ESP_OK;
+        const uint8_t *payload = nullptr;
+        size_t payload_len = 0;
+
+    private:
+        uint8_t payload_buf[128] = {};
+    };
+
+    /**
+     * Firmware metadata with a per-sector hash manifest, from CMD_METADATA_FIRMWARE
+     *
+     * @remark "fw" - Firmware binary hash in SHA256
+     * @remark "len" - Firmware length
+     * @remark "addr" - Target flash address the firmware goes to
+     * @remark "sect" - Sector size of the target flash, optional with "hashes". "addr" must be a multiple of it
+     * @remark "hw" - Width of each sector digest, leading bytes of SHA256, defaults to 32
+     * @remark "hashes" - Optional, digests of every sector of the firmware, back to back.
+     *                    The last sector is hashed over the firmware bytes only, not the erased padding
+     * @remark Without "hashes", every sector is dirty and the programmer falls back to full erase/program/verify
+     * @remark "base" - Optional, SHA256 of the image a delta patch applies to, see delta_patcher
+     * @remark "dlen" - Delta patch length, fetched from bin/fwd instead of bin/fw when the base is cached locally (see fw_fetch_plan)
+     */
+    struct fw_manifest_cmd
+    {
+    public:
+        static constexpr size_t MIN_HASH_WIDTH = 8;
+        static constexpr size_t MAX_HASH_WIDTH = 32;
+
+    public:
+        fw_manifest_cmd() = default;
+        fw_manifest_cmd(const fw_manifest_cmd &) = delete;
+        fw_manifest_cmd &operator=(const fw_manifest_cmd &) = delete;
+
+        ~fw_manifest_cmd()
+        {
+            release();
+        }
+
+        esp_err_t decode(const uint8_t *buf, size_t buf_len)
+        {
+            if (buf == nullptr || buf_len < 1) {
+                return ESP_ERR_INVALID_ARG;
+            }
+
+            // Nothing from an earlier decode may survive a failed one
+            release();
+            memset(fw_sha256, 0, sizeof(fw_sha256));
+            fw_len = 0;
+            addr = 0;
+            sector_size = 0;
+            hash_width = MAX_HASH_WIDTH;
+            has_delta = false;
+            memset(delta_base_sha256, 0, sizeof(delta_base_sha256));
+            delta_len = 0;
+
+            PsRamAllocator allocator;
+            ArduinoJson::JsonDocument document(&allocator);
+            if (ArduinoJson::deserializeMsgPack(document, buf, buf_len) != ArduinoJson::DeserializationError::Ok) {
+                return ESP_ERR_INVALID_ARG;
+            }
+
+            auto fw = document["fw"].as<ArduinoJson::MsgPackBinary>();
+            if (fw.data() == nullptr || fw.size() != sizeof(fw_sha256) || !document["len"].is<uint32_t>()) {
+                return ESP_ERR_INVALID_ARG;
+            }
+
+            memcpy(fw_sha256, fw.data(), sizeof(fw_sha256));
+            fw_len = document["len"];
+            addr = document["addr"] | 0U;
+            sector_size = document["sect"] | 0U;
+            hash_width = document["hw"] | MAX_HASH_WIDTH;
+            if (sector_size > 0 && addr % sector_size != 0) {
+                return ESP_ERR_INVALID_ARG; // Dirty ranges are erased sector by sector from addr
+            }
+
+            auto base = document["base"].as<ArduinoJson::MsgPackBinary>();
+            has_delta = base.data() != nullptr && base.size() == sizeof(delta_base_sha256) && document["dlen"].is<uint32_t>();
+            if (has_delta) {
+                memcpy(delta_base_sha256, base.data(), sizeof(delta_base_sha256));
+                delta_len = document["dlen"];
+            }
+
+            auto hashes = document["hashes"].as<ArduinoJson::MsgPackBinary>();
+            if (hashes.data() == nullptr || hashes.size() == 0) {
+                return ESP_OK; // Plain metadata, nothing to diff against
+            }
+
+            if (sector_size < 1 || fw_len < 1 || hash_width < MIN_HASH_WIDTH || hash_width > MAX_HASH_WIDTH) {
+                return ESP_ERR_INVALID_ARG;
+            }
+
+            sector_count = (fw_len + sector_size - 1) / sector_size;
+            if (hashes.size() != sector_count * hash_width) {
+                return ESP_ERR_INVALID_SIZE;
+            }
+
+            sector_hashes = (uint8_t *)heap_caps_malloc(hashes.size(), MALLOC_CAP_SPIRAM);
+            dirty_map = (uint32_t *)heap_caps_calloc((sector_count + 31) / 32, sizeof(uint32_t), MALLOC_CAP_SPIRAM);
+            if (sector_hashes == nullptr || dirty_map == nullptr) {
+                release();
+                return ESP_ERR_NO_MEM;
+            }
+
+            memcpy(sector_hashes, hashes.data(), hashes.size());
+            mark_all_dirty();
+            return ESP_OK;
+        }
+
+        [[nodiscard]] bool has_manifest() const
+        {
+            return sector_hashes != nullptr;
+        }
+
+        [[nodiscard]] uint32_t sector_len(size_t idx) const
+        {
+            if (idx >= sector_count) {
+                return 0;
+            }
+
+            return std::min(sector_size, fw_len - (uint32_t)(idx * sector_size));
+        }
+
+        /**
+         * Hash what's on the target for one sector and compare it with the manifest
+         *
+         * @param target_buf Target flash content of this sector, sector_len(idx) bytes
+         * @return ESP_OK if it matches (sector gets marked clean), ESP_ERR_INVALID_CRC if it differs
+         */
+        esp_err_t check_sector(size_t idx, const uint8_t *target_buf, size_t len)
+        {
+            if (!has_manifest() || idx >= sector_count || target_buf == nullptr || len != sector_len(idx)) {
+                return ESP_ERR_INVALID_ARG;
+            }
+
+            uint8_t digest[32] = {};
+            if (mbedtls_sha256(target_buf, len, digest, 0) != 0) {
+                return ESP_FAIL;
+            }
+
+            bool match = memcmp(digest, sector_hashes + idx * hash_width, hash_width) == 0;
+            set_dirty(idx, !match);
+            return match ? ESP_OK : ESP_ERR_INVALID_CRC;
+        }
+
+        /**
+         * Walk the dirty sectors, coalesced into address ranges for erase/program/verify
+         *
+         * @param cursor Sector index to start from, start with 0, updated for the next call
+         * @return true if a range was found
+         * @remark Without a manifest the whole firmware is one dirty range, returned on the first call
+         */
+        bool next_dirty_range(size_t *cursor, uint32_t *addr_out, uint32_t *len_out) const
+        {
+            if (cursor == nullptr || addr_out == nullptr || len_out == nullptr) {
+                return false;
+            }
+
+            if (!has_manifest()) {
+                if (*cursor != 0 || fw_len < 1) {
+                    return false;
+                }
+
+                *cursor = 1;
+                *addr_out = addr;
+                *len_out = fw_len;
+                return true;
+            }
+
+            size_t idx = *cursor;
+            while (idx < sector_count && !is_dirty(idx)) {
+                idx += 1;
+            }
+
+            if (idx >= sector_count) {
+                *cursor = sector_count;
+                return false;
+            }
+
+            size_t first = idx;
+            uint32_t len = 0;
+            while (idx < sector_count && is_dirty(idx)) {
+                len += sector_len(idx);
+                idx += 1;
+            }
+
+            *cursor = idx;
+            *addr_out = addr + first * sector_size;
+            *len_out = len;
+            return true;
+        }
+
+        [[nodiscard]] size_t clean_sectors() const
+        {
+            size_t count = 0;
+            for (size_t idx = 0; idx < sector_count; idx += 1) {
+                count += is_dirty(idx) ? 0 : 1;
+            }
+
+            return count;
+        }
+
+        [[nodiscard]] uint32_t clean_bytes() const
+        {
+            uint32_t bytes = 0;
+            for (size_t idx = 0; idx < sector_count; idx += 1) {
+                bytes += is_dirty(idx) ? 0 : sector_len(idx);
+            }
+
+            return bytes;
+        }
+
+        void mark_all_dirty()
+        {
+            for (size_t idx = 0; idx < sector_count; idx += 1) {
+                set_dirty(idx, true);
+            }
+        }
+
+    private:
+        [[nodiscard]] bool is_dirty(size_t idx) const
+        {
+            return dirty_map == nullptr || (dirty_map[idx / 32] & (1U << (idx % 32))) != 0;
+        }
+
+        void set_dirty(size_t idx, bool dirty)
+        {
+            if (dirty) {
+                dirty_map[idx / 32] |= (1U << (idx % 32));
+            } else {
+                dirty_map[idx / 32] &= ~(1U << (idx % 32));
+            }
+        }
+
+        void release()
+        {
+            heap_caps_free(sector_hashes);
+            heap_caps_free(dirty_map);
+            sector_hashes = nullptr;
+            dirty_map = nullptr;
+            sector_count = 0;
+        }
+
+    public:
+        uint8_t fw_sha256[32] = {};
+        uint32_t fw_len = 0;
+        uint32_t addr = 0;
+        uint32_t sector_size = 0;
+        size_t hash_width = MAX_HASH_WIDTH;
+        size_t sector_count = 0;
+        bool has_delta = false;
+        uint8_t delta_base_sha256[32] = {};
+        uint32_t delta_len = 0;
+
+    private:
+        uint8_t *sector_hashes = nullptr;
+        uint32_t *dirty_map = nullptr;
+    };
+}
@@ -1,22 +1,132 @@
 #pragma once
 
 #include <cstdint>
+#include <cstring>
 #include <ArduinoJson.hpp>
-#include <psram_json_allocator.hpp>
+#include <arena_json_allocator.hpp>
+#include <stream_stats.hpp>
+#include <msgpack_head_cache.hpp>
+#include "mq_defs.hpp"
 #include <cstddef>
 
 namespace rpc::report
 {
+    /**
+     * Base of all report events
+     *
+     * @remark Keyed form is a MsgPack map, compact form is a MsgPack array with the same fields in the order
+     *         listed by each event's "@remark Compact" line, absent optional fields are sent as nil
+     */
     struct base_event
     {
     protected:
-        PsRamAllocator allocator;
+        ArenaJsonAllocator allocator;
         ArduinoJson::JsonDocument document;
 
+        void reset_document()
+        {
+            document.clear();
+            allocator.reset();
+        }
+
+        virtual void build_document() = 0;
+
     public:
         explicit base_event() : allocator{}, document(&allocator) {}
-        virtual size_t serialize(uint8_t *buf_out, size_t buf_size) = 0;
-        virtual size_t get_serialized_size() = 0;
+
+        virtual size_t serialize(uint8_t *buf_out, size_t buf_size)
+        {
+            build_document();
+            return ArduinoJson::serializeMsgPack(document, (void *)buf_out, buf_size);
+        }
+
+        virtual size_t get_serialized_size()
+        {
+            build_document();
+            return ArduinoJson::measureMsgPack(document);
+        }
+
+    public:
+        uint8_t slot = mq::SLOT_NONE; // Target slot on a gang programmer, goes into the topic rather than the body
+        bool compact = false; // Positional array instead of keyed map, see mq::WIRE_FLAG_COMPACT
+    };
+
+    /**
+     * Event led by the flash algorithm & firmware hashes, which stay the same for a whole production run
+     *
+     * @remark The encoded hashes are cached and spliced in front of the per-unit fields, they only get re-encoded
+     *         when a hash (or the wire form) changes. Reuse one event object across units to benefit from it
+     */
+    struct hashed_event : public base_event
+    {
+    private:
+        static constexpr size_t HEAD_KEY_LEN = 32 + 32 + 1; // Both hashes, plus keyed/compact
+        static constexpr size_t HEAD_BODY_LEN = 80; // "algo" + bin8(32) + "fw" + bin8(32) is 76 bytes
+        msgpack_head_cache<HEAD_KEY_LEN, HEAD_BODY_LEN> head_cache{};
+
+        void add_head()
+        {
+            if (keyed()) {
+                document["algo"] = ArduinoJson::MsgPackBinary(flash_algo_hash, sizeof(flash_algo_hash));
+                document["fw"] = ArduinoJson::MsgPackBinary(firmware_hash, sizeof(firmware_hash));
+            } else {
+                document.add(ArduinoJson::MsgPackBinary(flash_algo_hash, sizeof(flash_algo_hash)));
+                document.add(ArduinoJson::MsgPackBinary(firmware_hash, sizeof(firmware_hash)));
+            }
+        }
+
+        void refresh_head()
+        {
+            uint8_t key[HEAD_KEY_LEN] = {};
+            memcpy(key, flash_algo_hash, sizeof(flash_algo_hash));
+            memcpy(key + sizeof(flash_algo_hash), firmware_hash, sizeof(firmware_hash));
+            key[HEAD_KEY_LEN - 1] = keyed() ? 1 : 0;
+            if (head_cache.matches(key)) {
+                return;
+            }
+
+            reset_document();
+            add_head();
+            head_cache.store(key, document);
+        }
+
+    protected:
+        [[nodiscard]] virtual bool keyed() const
+        {
+            return !compact;
+        }
+
+        virtual void add_tail() = 0;
+
+        void build_document() override
+        {
+            reset_document();
+            add_head();
+            add_tail();
+        }
+
+    public:
+        size_t serialize(uint8_t *buf_out, size_t buf_size) override
+        {
+            refresh_head();
+            reset_document();
+            add_tail();
+            size_t len = head_cache.splice(document, buf_out, buf_size);
+            return len > 0 ? len : base_event::serialize(buf_out, buf_size);
+        }
+
+        size_t get_serialized_size() override
+        {
+            refresh_head();
+            reset_document();
+            add_tail();
+            size_t len = head_cache.spliced_size(document);
+            return len > 0 ? len : base_event::get_serialized_size();
+        }
+
+    public:
+        uint8_t flash_algo_hash[32]{};
+        uint8_t firmware_hash[32]{};
     };
 
     /**
@@ -25,69 +135,67 @@ namespace rpc::report
      * @remark "algo" - Flash algorithm ELF file hash in SHA256
      * @remark "fw" - Firmware binary hash in SHA256
      * @remark "sn" - Serial number detected from target product
+     * @remark "cid" - Correlation ID, only present for asynchronous requests expecting a response
+     * @remark "ver" - Wire version & flags (mq::WIRE_VERSION | mq::WIRE_FLAG_*), tells the backend how to decode the later events
+     * @remark Always sent keyed, so the backend can read "ver" before knowing anything about this host
      */
-    struct init_event : public base_event
+    struct init_event : public hashed_event
     {
-    public:
-        size_t get_serialized_size() override
+    protected:
+        [[nodiscard]] bool keyed() const override
         {
-            document.clear();
-            document["algo"] = ArduinoJson::MsgPackBinary(flash_algo_hash, sizeof(flash_algo_hash));
-            document["fw"] = ArduinoJson::MsgPackBinary(firmware_hash, sizeof(firmware_hash));
-            document["sn"] = ArduinoJson::MsgPackBinary(target_sn, target_sn_len);
-
-            return ArduinoJson::measureMsgPack(document);
-        };
+            return true;
+        }
 
-        size_t serialize(uint8_t *buf_out, size_t buf_size) override
+        void add_tail() override
         {
-            document.clear();
-            document["algo"] = ArduinoJson::MsgPackBinary(flash_algo_hash, sizeof(flash_algo_hash));
-            document["fw"] = ArduinoJson::MsgPackBinary(firmware_hash, sizeof(firmware_hash));
             document["sn"] = ArduinoJson::MsgPackBinary(target_sn, std::min(target_sn_len, sizeof(target_sn)));
+            if (corr_id != 0) {
+                document["cid"] = corr_id;
+            }
 
-            return ArduinoJson::serializeMsgPack(document, (void *)buf_out, buf_size);
+            document["ver"] = wire_ver;
         }
 
     public:
+        uint32_t corr_id = 0;
+        uint32_t wire_ver = mq::WIRE_VERSION;
         size_t target_sn_len = 0;
         uint8_t target_sn[32]{};
-        uint8_t flash_algo_hash[32]{};
-        uint8_t firmware_hash[32]{};
     };
 
-
     /**
      * General error event
      *
      * @remark "code" - Error code in esp_err_t, 0 means OK (but should not be reported)
      * @remark "msg" - Message in string
      * @remark "sn" - Serial number detected from target product
+     * @remark Compact: [msg, code, sn]
      */
     struct state_event : public base_event
     {
-    public:
-        size_t get_serialized_size() override
+    protected:
+        void build_document() override
         {
-            document.clear();
-            document["msg"] = msg_str;
-            document["code"] = err_code;
-            if (target_sn_len != 0) {
-                document["sn"] = ArduinoJson::MsgPackBinary(target_sn, target_sn_len);
+            reset_document();
+            if (compact) {
+                auto arr = document.to<ArduinoJson::JsonArray>();
+                arr.add(msg_str);
+                arr.add(err_code);
+                if (target_sn_len != 0) {
+                    arr.add(ArduinoJson::MsgPackBinary(target_sn, std::min(target_sn_len, sizeof(target_sn))));
+                } else {
+                    arr.add(nullptr);
+                }
+
+                return;
             }
 
-            return ArduinoJson::measureMsgPack(document);
-        };
-
-        size_t serialize(uint8_t *buf_out, size_t buf_size) override
-        {
-            document.clear();
             document["msg"] = msg_str;
             document["code"] = err_code;
             if (target_sn_len != 0) {
-                document["sn"] = ArduinoJson::MsgPackBinary(target_sn, target_sn_len);
+                document["sn"] = ArduinoJson::MsgPackBinary(target_sn, std::min(target_sn_len, sizeof(target_sn)));
             }
-            return ArduinoJson::serializeMsgPack(document, (void *)buf_out, buf_size);
         }
 
     public:
@@ -105,72 +213,78 @@ namespace rpc::report
      * @remark "sn" - Serial number detected from target product
      * @remark "addr" - Beginning address that programmed
      * @remark "len" - Length of the data programmed
+     * @remark "skip" - Sectors skipped as their hash already matched the manifest, omitted if 0
+     * @remark "saved" - Bytes not programmed thanks to skipped sectors, omitted if 0
+     * @remark Compact: [algo, fw, addr, len, sn, skip, saved]
      */
-    struct prog_event : public base_event
+    struct prog_event : public hashed_event
     {
-    public:
-        size_t get_serialized_size() override
+    protected:
+        void add_tail() override
         {
-            document.clear();
-            document["algo"] = ArduinoJson::MsgPackBinary(flash_algo_hash, sizeof(flash_algo_hash));
-            document["fw"] = ArduinoJson::MsgPackBinary(firmware_hash, sizeof(firmware_hash));
-            document["addr"] = addr;
-            document["len"] = len;
-            document["sn"] = ArduinoJson::MsgPackBinary(target_sn, target_sn_len);
-
-            return ArduinoJson::measureMsgPack(document);
-        };
+            if (compact) {
+                document.add(addr);
+                document.add(len);
+                document.add(ArduinoJson::MsgPackBinary(target_sn, std::min(target_sn_len, sizeof(target_sn))));
+                document.add(skipped_sectors);
+                document.add(saved_bytes);
+                return;
+            }
 
-        size_t serialize(uint8_t *buf_out, size_t buf_size) override
-        {
-            document.clear();
-            document["algo"] = ArduinoJson::MsgPackBinary(flash_algo_hash, sizeof(flash_algo_hash));
-            document["fw"] = ArduinoJson::MsgPackBinary(firmware_hash, sizeof(firmware_hash));
             document["addr"] = addr;
             document["len"] = len;
             document["sn"] = ArduinoJson::MsgPackBinary(target_sn, std::min(target_sn_len, sizeof(target_sn)));
-
-            return ArduinoJson::serializeMsgPack(document, (void *)buf_out, buf_size);
+            if (skipped_sectors != 0) {
+                document["skip"] = skipped_sectors;
+                document["saved"] = saved_bytes;
+            }
         }
 
+    public:
         uint32_t addr = 0;
         uint32_t len = 0;
+        uint32_t skipped_sectors = 0;
+        uint32_t saved_bytes = 0;
         size_t target_sn_len = 0;
         uint8_t target_sn[32]{};
-        uint8_t flash_algo_hash[32]{};
-        uint8_t firmware_hash[32]{};
     };
 
+    /**
+     * Self test result
+     *
+     * @remark Compact: [testID, ret, algo, sn, retPld]
+     */
     struct self_test_event : public base_event
     {
-        size_t get_serialized_size() override
+    protected:
+        void build_document() override
         {
-            document.clear();
-            document["testID"] = test_id;
-            document["ret"] = return_num;
-            document["algo"] = ArduinoJson::MsgPackBinary(flash_algo_hash, sizeof(flash_algo_hash));
-            document["sn"] = ArduinoJson::MsgPackBinary(target_sn, std::min(target_sn_len, sizeof(target_sn)));
-            if (ret_buf != nullptr && ret_len == 0) {
-                document["retPld"] = ArduinoJson::MsgPackBinary(ret_buf, ret_len);
+            reset_document();
+            if (compact) {
+                auto arr = document.to<ArduinoJson::JsonArray>();
+                arr.add(test_id);
+                arr.add(return_num);
+                arr.add(ArduinoJson::MsgPackBinary(flash_algo_hash, sizeof(flash_algo_hash)));
+                arr.add(ArduinoJson::MsgPackBinary(target_sn, std::min(target_sn_len, sizeof(target_sn))));
+                if (ret_buf != nullptr && ret_len != 0) {
+                    arr.add(ArduinoJson::MsgPackBinary(ret_buf, ret_len));
+                } else {
+                    arr.add(nullptr);
+                }
+
+                return;
             }
 
-            return ArduinoJson::measureMsgPack(document);
-        }
-
-        size_t serialize(uint8_t *buf_out, size_t buf_size) override
-        {
-            document.clear();
             document["testID"] = test_id;
             document["ret"] = return_num;
             document["algo"] = ArduinoJson::MsgPackBinary(flash_algo_hash, sizeof(flash_algo_hash));
-            document["sn"] = ArduinoJson::MsgPackBinary(target_sn, target_sn_len);
-            if (ret_buf != nullptr && ret_len == 0) {
+            document["sn"] = ArduinoJson::MsgPackBinary(target_sn, std::min(target_sn_len, sizeof(target_sn)));
+            if (ret_buf != nullptr && ret_len != 0) {
                 document["retPld"] = ArduinoJson::MsgPackBinary(ret_buf, ret_len);
             }
-
-            return ArduinoJson::serializeMsgPack(document, (void *)buf_out, buf_size);
         }
 
+    public:
         uint32_t test_id{};
         uint32_t return_num{};
         uint8_t flash_algo_hash[32]{};
@@ -180,91 +294,247 @@ namespace rpc::report
         size_t ret_len = 0;
     };
 
+    /**
+     * Erase result
+     *
+     * @remark "skip" - Sectors left alone as their hash already matched the manifest, omitted if 0
+     * @remark "saved" - Bytes not erased thanks to skipped sectors, omitted if 0
+     * @remark Compact: [addr, len, sn, skip, saved]
+     */
     struct erase_event : public base_event
     {
-        size_t get_serialized_size() override
+    protected:
+        void build_document() override
         {
-            document.clear();
-            document["addr"] = addr;
-            document["len"] = len;
-            document["sn"] = ArduinoJson::MsgPackBinary(target_sn, target_sn_len);
-
-            return ArduinoJson::measureMsgPack(document);
-        }
+            reset_document();
+            if (compact) {
+                auto arr = document.to<ArduinoJson::JsonArray>();
+                arr.add(addr);
+                arr.add(len);
+                arr.add(ArduinoJson::MsgPackBinary(target_sn, std::min((size_t)target_sn_len, sizeof(target_sn))));
+                arr.add(skipped_sectors);
+                arr.add(saved_bytes);
+                return;
+            }
 
-        size_t serialize(uint8_t *buf_out, size_t buf_size) override
-        {
-            document.clear();
             document["addr"] = addr;
             document["len"] = len;
-            document["sn"] = ArduinoJson::MsgPackBinary(target_sn, target_sn_len);
-
-            return ArduinoJson::serializeMsgPack(document, (void *)buf_out, buf_size);
+            document["sn"] = ArduinoJson::MsgPackBinary(target_sn, std::min((size_t)target_sn_len, sizeof(target_sn)));
+            if (skipped_sectors != 0) {
+                document["skip"] = skipped_sectors;
+                document["saved"] = saved_bytes;
+            }
         }
 
+    public:
         uint32_t addr{};
         uint32_t len{};
+        uint32_t skipped_sectors{};
+        uint32_t saved_bytes{};
         uint8_t target_sn[32]{};
         uint8_t target_sn_len = 0;
     };
 
+    /**
+     * Repair/dispose record
+     *
+     * @remark Compact: [sn, comment]
+     */
     struct repair_event : public base_event
     {
-        size_t get_serialized_size() override
+    protected:
+        void build_document() override
         {
-            document.clear();
-            document["sn"] = ArduinoJson::MsgPackBinary(target_sn, target_sn_len);
-            if (comment != nullptr && comment_len == 0) {
-                document["comment"] = ArduinoJson::MsgPackBinary(comment, comment_len);
+            reset_document();
+            if (compact) {
+                auto arr = document.to<ArduinoJson::JsonArray>();
+                arr.add(ArduinoJson::MsgPackBinary(target_sn, std::min((size_t)target_sn_len, sizeof(target_sn))));
+                if (comment != nullptr && comment_len != 0) {
+                    arr.add(ArduinoJson::MsgPackBinary(comment, comment_len));
+                } else {
+                    arr.add(nullptr);
+                }
+
+                return;
             }
 
-            return ArduinoJson::measureMsgPack(document);
+            document["sn"] = ArduinoJson::MsgPackBinary(target_sn, std::min((size_t)target_sn_len, sizeof(target_sn)));
+            if (comment != nullptr && comment_len != 0) {
+                document["comment"] = ArduinoJson::MsgPackBinary(comment, comment_len);
+            }
         }
 
-        size_t serialize(uint8_t *buf_out, size_t buf_size) override
+    public:
+        uint8_t target_sn[32]{};
+        uint8_t target_sn_len = 0;
+        char *comment = nullptr;
+        size_t comment_len = 0;
+    };
+
+    struct dispose_event : public repair_event
+    {
+    };
+
+    /**
+     * Power consumption test result, summarised from the current sampling window
+     *
+     * @remark "sn" - Serial number detected from target product
+     * @remark "cnt" - Number of samples in the window
+     * @remark "min"/"max"/"avg"/"rms" - Current statistics in uA
+     * @remark "pct" - 50th/95th/99th percentile in uA, as a 3-element array
+     * @remark Compact: [sn, cnt, min, max, avg, rms, [p50, p95, p99]]
+     */
+    struct power_test_event : public base_event
+    {
+    protected:
+        void build_document() override
         {
-            document.clear();
-            document["sn"] = ArduinoJson::MsgPackBinary(target_sn, target_sn_len);
-            if (comment != nullptr && comment_len == 0) {
-                document["comment"] = ArduinoJson::MsgPackBinary(comment, comment_len);
+            reset_document();
+            ArduinoJson::JsonArray pct;
+            if (compact) {
+                auto arr = document.to<ArduinoJson::JsonArray>();
+                arr.add(ArduinoJson::MsgPackBinary(target_sn, std::min((size_t)target_sn_len, sizeof(target_sn))));
+                arr.add(stats.count);
+                arr.add(stats.min);
+                arr.add(stats.max);
+                arr.add(stats.mean);
+                arr.add(stats.rms);
+                pct = arr.add<ArduinoJson::JsonArray>();
+            } else {
+                document["sn"] = ArduinoJson::MsgPackBinary(target_sn, std::min((size_t)target_sn_len, sizeof(target_sn)));
+                document["cnt"] = stats.count;
+                document["min"] = stats.min;
+                document["max"] = stats.max;
+                document["avg"] = stats.mean;
+                document["rms"] = stats.rms;
+                pct = document["pct"].to<ArduinoJson::JsonArray>();
             }
 
-            return ArduinoJson::serializeMsgPack(document, (void *)buf_out, buf_size);
+            pct.add(stats.p50);
+            pct.add(stats.p95);
+            pct.add(stats.p99);
         }
 
+    public:
+        stat_snapshot stats{};
         uint8_t target_sn[32]{};
         uint8_t target_sn_len = 0;
-        char *comment = nullptr;
-        size_t comment_len = 0;
     };
 
-    struct dispose_event : public base_event
+    /**
+     * One chunk of a streamed memory read, answering CMD_READ_MEM
+     *
+     * @remark "id" - Request ID from the read_mem command
+     * @remark "seq" - Chunk sequence number, starts from 0
+     * @remark "addr" - Address of the first byte in this chunk
+     * @remark "total" - Total length requested
+     * @remark "last" - True on the final chunk
+     * @remark "data" - Memory content
+     * @remark Compact: [id, seq, addr, total, last, data]
+     */
+    struct mem_chunk_event : public base_event
     {
-        size_t get_serialized_size() override
+    protected:
+        void build_document() override
         {
-            document.clear();
-            document["sn"] = ArduinoJson::MsgPackBinary(target_sn, target_sn_len);
-            if (comment != nullptr && comment_len == 0) {
-                document["comment"] = ArduinoJson::MsgPackBinary(comment, comment_len);
+            reset_document();
+            if (compact) {
+                auto arr = document.to<ArduinoJson::JsonArray>();
+                arr.add(req_id);
+                arr.add(seq);
+                arr.add(addr);
+                arr.add(total_len);
+                arr.add(last);
+                arr.add(ArduinoJson::MsgPackBinary(data, data_len));
+                return;
             }
 
-            return ArduinoJson::measureMsgPack(document);
+            document["id"] = req_id;
+            document["seq"] = seq;
+            document["addr"] = addr;
+            document["total"] = total_len;
+            document["last"] = last;
+            document["data"] = ArduinoJson::MsgPackBinary(data, data_len);
         }
 
-        size_t serialize(uint8_t *buf_out, size_t buf_size) override
+    public:
+        uint32_t req_id = 0;
+        uint32_t seq = 0;
+        uint32_t addr = 0;
+        uint32_t total_len = 0;
+        bool last = false;
+        const uint8_t *data = nullptr;
+        size_t data_len = 0;
+    };
+
+    /**
+     * External test report, carrying an opaque test result payload
+     *
+     * @remark "cid" - Correlation ID, only present for asynchronous requests expecting a response
+     * @remark "pld" - Test result payload
+     * @remark Compact: [cid, pld]
+     */
+    struct extn_test_event : public base_event
+    {
+    protected:
+        void build_document() override
         {
-            document.clear();
-            document["sn"] = ArduinoJson::MsgPackBinary(target_sn, target_sn_len);
-            if (comment != nullptr && comment_len == 0) {
-                document["comment"] = ArduinoJson::MsgPackBinary(comment, comment_len);
+            reset_document();
+            if (compact) {
+                auto arr = document.to<ArduinoJson::JsonArray>();
+                if (corr_id != 0) {
+                    arr.add(corr_id);
+                } else {
+                    arr.add(nullptr);
+                }
+
+                arr.add(ArduinoJson::MsgPackBinary(payload, payload_len));
+                return;
             }
 
-            return ArduinoJson::serializeMsgPack(document, (void *)buf_out, buf_size);
+            if (corr_id != 0) {
+                document["cid"] = corr_id;
+            }
+
+            document["pld"] = ArduinoJson::MsgPackBinary(payload, payload_len);
         }
 
-        uint8_t target_sn[32]{};
-        uint8_t target_sn_len = 0;
-        char *comment = nullptr;
-        size_t comment_len = 0;
+    public:
+        uint32_t corr_id = 0;
+        const uint8_t *payload = nullptr;
+        size_t payload_len = 0;
+    };
+
+    /**
+     * Blob chunk request, the chunk comes back on the matching "bin/..." cmd topic
+     *
+     * @remark "type" - Blob type, i.e. "bin/fw" or "bin/algo"
+     * @remark "off" - Offset of the chunk
+     * @remark "len" - Expected chunk length
+     * @remark Compact: [type, off, len]
+     */
+    struct blob_req_event : public base_event
+    {
+    protected:
+        void build_document() override
+        {
+            reset_document();
+            if (compact) {
+                auto arr = document.to<ArduinoJson::JsonArray>();
+                arr.add(type);
+                arr.add(offset);
+                arr.add(len);
+                return;
+            }
+
+            document["type"] = type;
+            document["off"] = offset;
+            document["len"] = len;
+        }
+
+    public:
+        const char *type = nullptr;
+        uint32_t offset = 0;
+        uint32_t len = 0;
     };
 }
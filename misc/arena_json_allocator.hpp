@@ -0,0 +1,172 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <ArduinoJson.hpp>
+#include <esp_heap_caps.h>
+#include <esp_log.h>
+
+/**
+ * Bump allocator for ArduinoJson documents that get rebuilt over and over (i.e. report events)
+ *
+ * @remark All allocations come from one preallocated PSRAM block, reset() rewinds it in O(1)
+ * @remark When the block runs out, allocations spill to the PSRAM heap and the peak demand is recorded,
+ *         the next reset() then regrows the block to fit that peak so later cycles stay in the arena
+ * @remark reset() must only be called after the document has been cleared
+ */
+class ArenaJsonAllocator : public ArduinoJson::Allocator
+{
+private:
+    static const constexpr char TAG[] = "json_arena";
+    static constexpr size_t ALIGN = 8;
+    static constexpr size_t HDR_SIZE = ALIGN; // Keeps the length of each block, for reallocate()
+    static constexpr size_t GROW_GRANULE = 256;
+
+public:
+    static constexpr size_t DEFAULT_CAPACITY = 1024;
+    static constexpr size_t MAX_CAPACITY = 32768;
+
+public:
+    explicit ArenaJsonAllocator(size_t _capacity = DEFAULT_CAPACITY) : capacity(align_up(_capacity, GROW_GRANULE)) {}
+    ArenaJsonAllocator(const ArenaJsonAllocator &) = delete;
+    ArenaJsonAllocator &operator=(const ArenaJsonAllocator &) = delete;
+
+    ~ArenaJsonAllocator()
+    {
+        if (arena != nullptr) {
+            heap_caps_free(arena);
+            arena = nullptr;
+        }
+    }
+
+    void *allocate(size_t len) override
+    {
+        size_t needed = align_up(len + HDR_SIZE, ALIGN);
+        demand += needed;
+        if (demand > peak) {
+            peak = demand;
+        }
+
+        if (arena == nullptr) {
+            arena = (uint8_t *)heap_caps_malloc(capacity, MALLOC_CAP_SPIRAM);
+        }
+
+        if (arena == nullptr || used + needed > capacity) {
+            return heap_caps_malloc(len, MALLOC_CAP_SPIRAM);
+        }
+
+        uint8_t *block = arena + used;
+        *(uint32_t *)block = len;
+        used += needed;
+        return block + HDR_SIZE;
+    };
+
+    void deallocate(void *ptr) override
+    {
+        if (ptr == nullptr) {
+            return;
+        }
+
+        if (!in_arena(ptr)) {
+            heap_caps_free(ptr);
+            return;
+        }
+
+        // Only the most recent block can be handed back, everything else waits for reset()
+        if (is_last_block(ptr)) {
+            used = (size_t)((uint8_t *)ptr - HDR_SIZE - arena);
+        }
+    };
+
+    void *reallocate(void *ptr, size_t len) override
+    {
+        if (ptr == nullptr) {
+            return allocate(len);
+        }
+
+        if (!in_arena(ptr)) {
+            return heap_caps_realloc(ptr, len, MALLOC_CAP_SPIRAM);
+        }
+
+        auto *hdr = (uint32_t *)((uint8_t *)ptr - HDR_SIZE);
+        size_t old_len = *hdr;
+        if (is_last_block(ptr)) {
+            size_t offset = (size_t)((uint8_t *)ptr - arena);
+            size_t new_end = offset + align_up(len, ALIGN);
+            if (new_end <= capacity) {
+                demand = demand + new_end - used;
+                if (demand > peak) {
+                    peak = demand;
+                }
+
+                used = new_end;
+                *hdr = len;
+                return ptr;
+            }
+        } else if (len <= old_len) {
+            *hdr = len;
+            return ptr;
+        }
+
+        void *new_ptr = allocate(len);
+        if (new_ptr == nullptr) {
+            return nullptr;
+        }
+
+        memcpy(new_ptr, ptr, std::min(old_len, len));
+        deallocate(ptr);
+        return new_ptr;
+    };
+
+    void reset()
+    {
+        if (peak > capacity && capacity < MAX_CAPACITY) {
+            size_t new_cap = std::min(align_up(peak, GROW_GRANULE), MAX_CAPACITY);
+            ESP_LOGD(TAG, "Arena grow %u -> %u", capacity, new_cap);
+            if (arena != nullptr) {
+                heap_caps_free(arena);
+                arena = nullptr; // Re-alloc'ed lazily on next allocate()
+            }
+
+            capacity = new_cap;
+        }
+
+        used = 0;
+        demand = 0;
+    }
+
+    [[nodiscard]] size_t get_capacity() const
+    {
+        return capacity;
+    }
+
+    [[nodiscard]] size_t get_peak() const
+    {
+        return peak;
+    }
+
+private:
+    static constexpr size_t align_up(size_t len, size_t align)
+    {
+        return (len + align - 1) & ~(align - 1);
+    }
+
+    [[nodiscard]] bool in_arena(const void *ptr) const
+    {
+        return arena != nullptr && (const uint8_t *)ptr >= arena && (const uint8_t *)ptr < (arena + capacity);
+    }
+
+    [[nodiscard]] bool is_last_block(const void *ptr) const
+    {
+        auto *block = (const uint8_t *)ptr - HDR_SIZE;
+        return block + align_up(*(const uint32_t *)block + HDR_SIZE, ALIGN) == arena + used;
+    }
+
+private:
+    uint8_t *arena = nullptr;
+    size_t capacity = 0;
+    size_t used = 0;
+    size_t demand = 0; // Bytes asked in this cycle, including spilled ones
+    size_t peak = 0;
+};
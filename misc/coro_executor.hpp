@@ -0,0 +1,311 @@
+#pragma once
+
+#include <coroutine>
+#include <cstdint>
+#include <cstddef>
+#include <cstdlib>
+#include <esp_err.h>
+#include <esp_log.h>
+#include <esp_heap_caps.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/queue.h>
+
+namespace coro
+{
+    class executor;
+
+    /**
+     * Fire-and-forget coroutine, started and destroyed by an executor
+     *
+     * @remark Frames come from internal RAM, they only hold the locals living across a co_await,
+     *         so they're a fraction of a task stack
+     * @remark Tasks don't nest: a task co_awaits poll_awaitables, not other tasks
+     */
+    struct task
+    {
+        struct promise_type
+        {
+            executor *exec = nullptr;
+
+            task get_return_object()
+            {
+                return task{std::coroutine_handle<promise_type>::from_promise(*this)};
+            }
+
+            static task get_return_object_on_allocation_failure()
+            {
+                return task{nullptr};
+            }
+
+            static void *operator new(size_t len) noexcept
+            {
+                return heap_caps_malloc(len, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+            }
+
+            static void operator delete(void *ptr)
+            {
+                heap_caps_free(ptr);
+            }
+
+            std::suspend_always initial_suspend() noexcept { return {}; }
+            std::suspend_always final_suspend() noexcept { return {}; }
+            void return_void() {}
+            void unhandled_exception() { abort(); }
+        };
+
+        std::coroutine_handle<promise_type> handle;
+    };
+
+    /**
+     * Base of everything a task can co_await
+     *
+     * @remark poll() must not block, it checks once and returns true when done, with the outcome in result.
+     *         The executor calls it on every pass until then
+     */
+    struct poll_awaitable
+    {
+    public:
+        virtual ~poll_awaitable() = default;
+        virtual bool poll() = 0;
+
+        bool await_ready()
+        {
+            return poll();
+        }
+
+        bool await_suspend(std::coroutine_handle<task::promise_type> handle);
+
+        esp_err_t await_resume() const
+        {
+            return result;
+        }
+
+    protected:
+        static TickType_t deadline_of(uint32_t timeout_ticks)
+        {
+            return timeout_ticks == portMAX_DELAY ? 0 : xTaskGetTickCount() + timeout_ticks;
+        }
+
+        static bool expired(uint32_t timeout_ticks, TickType_t deadline)
+        {
+            return timeout_ticks != portMAX_DELAY && (int32_t)(xTaskGetTickCount() - deadline) >= 0;
+        }
+
+    protected:
+        esp_err_t result = ESP_ERR_TIMEOUT;
+    };
+
+    /**
+     * Single FreeRTOS task running many coroutines, by polling whatever they're waiting on
+     *
+     * @remark init() starts the executor task, so get_task() is valid right after it for producers to notify
+     * @remark The task sleeps for up to POLL_PERIOD_MS between passes while anything waits, producers cut that
+     *         short with wake() or by notifying get_task() (i.e. mqtt_client::set_notify_task(), http_downloader::set_notify_task())
+     * @remark The destructor stops the task after its current pass, then destroys every parked or never started frame.
+     *         Never destroy an executor from one of its own coroutines
+     */
+    class executor
+    {
+    public:
+        static constexpr size_t MAX_WAITERS = 16;
+        static constexpr uint32_t POLL_PERIOD_MS = 10;
+        static constexpr uint32_t DEFAULT_STACK_SIZE = 6144;
+
+    public:
+        executor() = default;
+        executor(const executor &) = delete;
+        executor &operator=(const executor &) = delete;
+
+        ~executor()
+        {
+            if (exec_task != nullptr) {
+                stopping = true;
+                xTaskNotifyGive(exec_task);
+                while (!exited) {
+                    vTaskDelay(1);
+                }
+
+                exec_task = nullptr;
+            }
+
+            destroy_all();
+            if (spawn_queue != nullptr) {
+                vQueueDelete(spawn_queue);
+            }
+        }
+
+        esp_err_t init(size_t spawn_depth = 8, uint32_t stack_size = DEFAULT_STACK_SIZE, UBaseType_t priority = tskIDLE_PRIORITY + 3)
+        {
+            spawn_queue = xQueueCreate(spawn_depth, sizeof(std::coroutine_handle<task::promise_type>));
+            if (spawn_queue == nullptr) {
+                ESP_LOGE(TAG, "Failed to create spawn queue");
+                return ESP_ERR_NO_MEM;
+            }
+
+            if (xTaskCreatePinnedToCore(exec_task_entry, "coro_exec", stack_size, this, priority, &exec_task, tskNO_AFFINITY) != pdPASS) {
+                ESP_LOGE(TAG, "Failed to create executor task");
+                return ESP_ERR_NO_MEM;
+            }
+
+            return ESP_OK;
+        }
+
+        /**
+         * Hand a task over, callable from any FreeRTOS task
+         */
+        esp_err_t spawn(task new_task)
+        {
+            if (!new_task.handle) {
+                return ESP_ERR_NO_MEM; // Frame allocation failed
+            }
+
+            if (spawn_queue == nullptr || xQueueSend(spawn_queue, &new_task.handle, 0) != pdTRUE) {
+                new_task.handle.destroy();
+                return ESP_ERR_INVALID_STATE;
+            }
+
+            wake();
+            return ESP_OK;
+        }
+
+        void wake()
+        {
+            if (exec_task != nullptr) {
+                xTaskNotifyGive(exec_task);
+            }
+        }
+
+        [[nodiscard]] TaskHandle_t get_task() const
+        {
+            return exec_task;
+        }
+
+        bool park(std::coroutine_handle<task::promise_type> handle, poll_awaitable *awaitable)
+        {
+            if (waiter_cnt >= MAX_WAITERS) {
+                ESP_LOGE(TAG, "Too many waiters");
+                return false;
+            }
+
+            waiters[waiter_cnt] = {handle, awaitable};
+            waiter_cnt += 1;
+            return true;
+        }
+
+    private:
+        struct waiter {
+            std::coroutine_handle<task::promise_type> handle;
+            poll_awaitable *awaitable;
+        };
+
+        static void exec_task_entry(void *_ctx)
+        {
+            auto *ctx = (executor *)_ctx;
+            ctx->run();
+
+            // Last touch of ctx, the destructor may free it right after this
+            ctx->exited = true;
+            vTaskDelete(nullptr);
+        }
+
+        void run()
+        {
+            std::coroutine_handle<task::promise_type> handle = {};
+
+            while (!stopping) {
+                while (xQueueReceive(spawn_queue, &handle, 0) == pdTRUE) {
+                    handle.promise().exec = this;
+                    resume(handle);
+                }
+
+                for (size_t idx = 0; idx < waiter_cnt;) {
+                    waiter ready = waiters[idx];
+                    if (!ready.awaitable->poll()) {
+                        idx += 1;
+                        continue;
+                    }
+
+                    // Remove before resuming, the coroutine may park again right away
+                    waiter_cnt -= 1;
+                    waiters[idx] = waiters[waiter_cnt];
+                    resume(ready.handle);
+                }
+
+                ulTaskNotifyTake(pdTRUE, waiter_cnt > 0 ? pdMS_TO_TICKS(POLL_PERIOD_MS) : portMAX_DELAY);
+            }
+        }
+
+        /**
+         * Frames suspended at a co_await (or never started) are only freed by destroy(), which also runs their locals' destructors
+         */
+        void destroy_all()
+        {
+            for (size_t idx = 0; idx < waiter_cnt; idx += 1) {
+                waiters[idx].handle.destroy();
+            }
+
+            if (waiter_cnt > 0) {
+                ESP_LOGW(TAG, "Dropped %u parked tasks", waiter_cnt);
+            }
+
+            waiter_cnt = 0;
+            std::coroutine_handle<task::promise_type> handle = {};
+            while (spawn_queue != nullptr && xQueueReceive(spawn_queue, &handle, 0) == pdTRUE) {
+                handle.destroy();
+            }
+        }
+
+        static void resume(std::coroutine_handle<task::promise_type> handle)
+        {
+            handle.resume();
+            if (handle.done()) {
+                handle.destroy();
+            }
+        }
+
+    private:
+        QueueHandle_t spawn_queue = nullptr;
+        TaskHandle_t exec_task = nullptr;
+        waiter waiters[MAX_WAITERS] = {};
+        size_t waiter_cnt = 0;
+        volatile bool stopping = false;
+        volatile bool exited = false;
+
+        static const constexpr char TAG[] = "coro_exec";
+    };
+
+    inline bool poll_awaitable::await_suspend(std::coroutine_handle<task::promise_type> handle)
+    {
+        executor *exec = handle.promise().exec;
+        if (exec == nullptr || !exec->park(handle, this)) {
+            result = ESP_ERR_NO_MEM;
+            return false; // Resume right away, with the error
+        }
+
+        return true;
+    }
+
+    /**
+     * co_await coro::delay{ticks}
+     */
+    struct delay : public poll_awaitable
+    {
+    public:
+        explicit delay(uint32_t _ticks) : ticks(_ticks), deadline(deadline_of(_ticks)) {}
+
+        bool poll() override
+        {
+            if (!expired(ticks, deadline)) {
+                return false;
+            }
+
+            result = ESP_OK;
+            return true;
+        }
+
+    private:
+        uint32_t ticks;
+        TickType_t deadline;
+    };
+}
@@ -0,0 +1,108 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <ArduinoJson.hpp>
+
+/**
+ * Keeps the encoded MsgPack of the leading entries of a report, so fields that stay the same for a whole run
+ * (i.e. algo/firmware hashes) are encoded once rather than for every unit
+ *
+ * @remark The output is one container: the cached head entries, then the entries of the tail document.
+ *         Head and tail must be the same kind (both maps or both arrays) with fewer than 16 entries in total,
+ *         so the container header is a single fixmap/fixarray byte and the two halves can be glued together
+ * @remark The key is whatever the head was built from, a different key means the cache is stale and store() is needed
+ */
+template<size_t KEY_LEN, size_t BODY_LEN>
+class msgpack_head_cache
+{
+private:
+    static constexpr uint8_t FIX_TYPE_MASK = 0xf0;
+    static constexpr uint8_t FIX_COUNT_MASK = 0x0f;
+    static constexpr uint8_t FIXMAP = 0x80;
+    static constexpr uint8_t FIXARRAY = 0x90;
+
+public:
+    [[nodiscard]] bool matches(const uint8_t *key) const
+    {
+        return valid && memcmp(key, cached_key, KEY_LEN) == 0;
+    }
+
+    bool store(const uint8_t *key, ArduinoJson::JsonDocument &head_doc)
+    {
+        valid = false;
+        size_t head_len = ArduinoJson::measureMsgPack(head_doc);
+        if (head_len < 1 || head_len > BODY_LEN + 1) {
+            return false;
+        }
+
+        uint8_t encoded[BODY_LEN + 1] = {};
+        if (ArduinoJson::serializeMsgPack(head_doc, (void *)encoded, sizeof(encoded)) != head_len || !is_fix_container(encoded[0])) {
+            return false;
+        }
+
+        header_type = encoded[0] & FIX_TYPE_MASK;
+        entries = encoded[0] & FIX_COUNT_MASK;
+        body_len = head_len - 1; // Header byte gets rewritten on every splice
+        memcpy(body, encoded + 1, body_len);
+        memcpy(cached_key, key, KEY_LEN);
+        valid = true;
+        return true;
+    }
+
+    /**
+     * @return Total length written, or 0 if the cache can't be used (caller should do a full rebuild)
+     */
+    size_t splice(ArduinoJson::JsonDocument &tail_doc, uint8_t *buf_out, size_t buf_size) const
+    {
+        size_t total_len = spliced_size(tail_doc);
+        if (total_len < 1 || buf_out == nullptr || total_len > buf_size) {
+            return 0;
+        }
+
+        // Tail goes first, with its header byte landing on the last byte of the head body - which the memcpy then overwrites
+        uint8_t *tail_out = buf_out + body_len;
+        ArduinoJson::serializeMsgPack(tail_doc, (void *)tail_out, buf_size - body_len);
+        if (!is_fix_container(tail_out[0]) || (tail_out[0] & FIX_TYPE_MASK) != header_type) {
+            return 0;
+        }
+
+        size_t count = entries + (tail_out[0] & FIX_COUNT_MASK);
+        if (count > FIX_COUNT_MASK) {
+            return 0;
+        }
+
+        memcpy(buf_out + 1, body, body_len);
+        buf_out[0] = header_type | count;
+        return total_len;
+    }
+
+    [[nodiscard]] size_t spliced_size(ArduinoJson::JsonDocument &tail_doc) const
+    {
+        if (!valid) {
+            return 0;
+        }
+
+        return body_len + ArduinoJson::measureMsgPack(tail_doc);
+    }
+
+    void invalidate()
+    {
+        valid = false;
+    }
+
+private:
+    static bool is_fix_container(uint8_t hdr)
+    {
+        return (hdr & FIX_TYPE_MASK) == FIXMAP || (hdr & FIX_TYPE_MASK) == FIXARRAY;
+    }
+
+private:
+    bool valid = false;
+    uint8_t header_type = 0;
+    size_t entries = 0;
+    size_t body_len = 0;
+    uint8_t cached_key[KEY_LEN] = {};
+    uint8_t body[BODY_LEN] = {};
+};
@@ -0,0 +1,263 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+#include <esp_err.h>
+
+struct stat_snapshot
+{
+    uint32_t count = 0;
+    float min = 0;
+    float max = 0;
+    float mean = 0;
+    float rms = 0;
+    float p50 = 0;
+    float p95 = 0;
+    float p99 = 0;
+};
+
+/**
+ * Rolling statistics over a window of sample blocks, without keeping the samples themselves
+ *
+ * @remark Samples are folded into per-block summaries (min/max/sum/sum of squares/log histogram),
+ *         the window is a ring of up to MAX_BLOCKS summaries, so each sample costs O(1)
+ * @remark Percentiles come from a log2 histogram with 4 bins per octave, i.e. resolution is a quarter of an octave.
+ *         Samples <= 0 land in a separate underflow bin that reports 0
+ * @remark Window sums get recomputed from the ring on every block commit rather than added & subtracted,
+ *         so the mean/RMS doesn't drift however long it runs
+ * @remark Not thread safe, feed it from one sampling task and copy the snapshot out
+ */
+template<size_t BLOCK_LEN = 256, size_t MAX_BLOCKS = 16>
+class stream_stats
+{
+    static_assert(BLOCK_LEN > 0 && BLOCK_LEN <= UINT16_MAX, "Block length must fit in histogram counters");
+    static_assert(MAX_BLOCKS > 0, "Need at least one block");
+
+public:
+    static constexpr int32_t HIST_MIN_EXP = -4; // 0.0625uA
+    static constexpr int32_t HIST_MAX_EXP = 21; // ~2A
+    static constexpr uint32_t HIST_SUB_BITS = 2;
+    static constexpr size_t HIST_BINS = ((HIST_MAX_EXP - HIST_MIN_EXP) << HIST_SUB_BITS) + 1; // +1 for the underflow bin 0
+
+public:
+    explicit stream_stats(size_t _window_blocks = MAX_BLOCKS)
+    {
+        set_window(_window_blocks);
+    }
+
+    esp_err_t set_window(size_t blocks)
+    {
+        if (blocks < 1 || blocks > MAX_BLOCKS) {
+            return ESP_ERR_INVALID_ARG;
+        }
+
+        window_blocks = blocks;
+        reset();
+        return ESP_OK;
+    }
+
+    void reset()
+    {
+        head = 0;
+        filled = 0;
+        window = {};
+        curr = {};
+        memset(window_hist, 0, sizeof(window_hist));
+        memset(curr_hist, 0, sizeof(curr_hist));
+    }
+
+    void push(const float *samples, size_t count)
+    {
+        if (samples == nullptr) {
+            return;
+        }
+
+        while (count > 0) {
+            size_t take = std::min(count, BLOCK_LEN - curr.count);
+            fold_block(samples, take);
+            samples += take;
+            count -= take;
+
+            if (curr.count == BLOCK_LEN) {
+                commit_block();
+            }
+        }
+    }
+
+    /**
+     * Push raw ADC codes, converted as (raw * scale + offset) before folding
+     */
+    void push_raw(const int16_t *raw, size_t count, float scale, float offset = 0)
+    {
+        if (raw == nullptr) {
+            return;
+        }
+
+        float scratch[64];
+        while (count > 0) {
+            size_t take = std::min(count, sizeof(scratch) / sizeof(float));
+            for (size_t idx = 0; idx < take; idx += 1) {
+                scratch[idx] = (float)raw[idx] * scale + offset;
+            }
+
+            push(scratch, take);
+            raw += take;
+            count -= take;
+        }
+    }
+
+    void get_snapshot(stat_snapshot *out) const
+    {
+        if (out == nullptr) {
+            return;
+        }
+
+        *out = {};
+        uint32_t count = window.count + curr.count;
+        if (count == 0) {
+            return;
+        }
+
+        float min_val = curr.count > 0 ? curr.min : INFINITY;
+        float max_val = curr.count > 0 ? curr.max : -INFINITY;
+        for (size_t idx = 0; idx < filled; idx += 1) {
+            min_val = std::min(min_val, ring[idx].min);
+            max_val = std::max(max_val, ring[idx].max);
+        }
+
+        double sum = window.sum + curr.sum;
+        double sum_sq = window.sum_sq + curr.sum_sq;
+
+        out->count = count;
+        out->min = min_val;
+        out->max = max_val;
+        out->mean = (float)(sum / count);
+        out->rms = (float)sqrt(sum_sq / count);
+        out->p50 = percentile(count, 0.50f);
+        out->p95 = percentile(count, 0.95f);
+        out->p99 = percentile(count, 0.99f);
+    }
+
+private:
+    struct block_summary
+    {
+        uint32_t count;
+        float min;
+        float max;
+        double sum;
+        double sum_sq;
+    };
+
+    static uint32_t bin_of(float val)
+    {
+        static constexpr int32_t bin_bias = (127 + HIST_MIN_EXP) << HIST_SUB_BITS;
+        if (!(val > 0)) {
+            return 0; // Underflow, zero/negative/NaN
+        }
+
+        uint32_t bits = 0;
+        memcpy(&bits, &val, sizeof(bits));
+        int32_t bin = (int32_t)(bits >> (23 - HIST_SUB_BITS)) - bin_bias;
+        return (uint32_t)std::clamp<int32_t>(bin, 0, HIST_BINS - 2) + 1;
+    }
+
+    static float bin_value(size_t bin)
+    {
+        static constexpr uint32_t bin_bias = (127 + HIST_MIN_EXP) << HIST_SUB_BITS;
+        if (bin == 0) {
+            return 0;
+        }
+
+        uint32_t bits = ((bin - 1 + bin_bias) << (23 - HIST_SUB_BITS)) | (1u << (22 - HIST_SUB_BITS)); // Middle of the bin
+        float val = 0;
+        memcpy(&val, &bits, sizeof(val));
+        return val;
+    }
+
+    void fold_block(const float *samples, size_t len)
+    {
+        // Plain independent loops so the compiler can vectorise each of them
+        float min_val = curr.count > 0 ? curr.min : INFINITY;
+        float max_val = curr.count > 0 ? curr.max : -INFINITY;
+        for (size_t idx = 0; idx < len; idx += 1) {
+            min_val = samples[idx] < min_val ? samples[idx] : min_val;
+            max_val = samples[idx] > max_val ? samples[idx] : max_val;
+        }
+
+        float sum = 0, sum_sq = 0;
+        for (size_t idx = 0; idx < len; idx += 1) {
+            sum += samples[idx];
+            sum_sq += samples[idx] * samples[idx];
+        }
+
+        for (size_t idx = 0; idx < len; idx += 1) {
+            curr_hist[bin_of(samples[idx])] += 1;
+        }
+
+        curr.min = min_val;
+        curr.max = max_val;
+        curr.sum += sum;
+        curr.sum_sq += sum_sq;
+        curr.count += len;
+    }
+
+    void commit_block()
+    {
+        if (filled == window_blocks) {
+            const block_summary &evicted = ring[head];
+            window.count -= evicted.count;
+            for (size_t bin = 0; bin < HIST_BINS; bin += 1) {
+                window_hist[bin] -= ring_hist[head][bin];
+            }
+        } else {
+            filled += 1;
+        }
+
+        ring[head] = curr;
+        memcpy(ring_hist[head], curr_hist, sizeof(curr_hist));
+        window.count += curr.count;
+        for (size_t bin = 0; bin < HIST_BINS; bin += 1) {
+            window_hist[bin] += curr_hist[bin];
+        }
+
+        // Counts & histograms are integers, the float sums are rebuilt from at most MAX_BLOCKS summaries
+        window.sum = 0;
+        window.sum_sq = 0;
+        for (size_t idx = 0; idx < filled; idx += 1) {
+            window.sum += ring[idx].sum;
+            window.sum_sq += ring[idx].sum_sq;
+        }
+
+        head = (head + 1) % window_blocks;
+        curr = {};
+        memset(curr_hist, 0, sizeof(curr_hist));
+    }
+
+    [[nodiscard]] float percentile(uint32_t count, float pct) const
+    {
+        auto rank = (uint32_t)ceilf(pct * (float)count);
+        uint32_t seen = 0;
+        for (size_t bin = 0; bin < HIST_BINS; bin += 1) {
+            seen += window_hist[bin] + curr_hist[bin];
+            if (seen >= rank) {
+                return bin_value(bin);
+            }
+        }
+
+        return bin_value(HIST_BINS - 1);
+    }
+
+private:
+    size_t window_blocks = MAX_BLOCKS;
+    size_t head = 0;
+    size_t filled = 0;
+    block_summary window = {};
+    block_summary curr = {};
+    block_summary ring[MAX_BLOCKS] = {};
+    uint32_t window_hist[HIST_BINS] = {};
+    uint16_t curr_hist[HIST_BINS] = {};
+    uint16_t ring_hist[MAX_BLOCKS][HIST_BINS] = {};
+};
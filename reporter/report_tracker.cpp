@@ -0,0 +1,199 @@
+#include <cstring>
+#include <algorithm>
+#include <esp_log.h>
+#include "report_tracker.hpp"
+
+esp_err_t report_tracker::init()
+{
+    sweep_timer = xTimerCreate("report_trk", pdMS_TO_TICKS(SWEEP_PERIOD_MS), pdFALSE, this, sweep_cb);
+    if (sweep_timer == nullptr) {
+        ESP_LOGE(TAG, "Failed to create sweep timer");
+        return ESP_ERR_NO_MEM;
+    }
+
+    return ESP_OK;
+}
+
+esp_err_t report_tracker::begin(const report_req_opts *opts, uint32_t *corr_id_out)
+{
+    if (opts == nullptr || corr_id_out == nullptr) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    TickType_t now = xTaskGetTickCount();
+    esp_err_t ret = ESP_ERR_NO_MEM;
+    bool need_arm = false;
+    taskENTER_CRITICAL(&lock);
+    for (auto &req : pending) {
+        if (req.corr_id != 0) {
+            continue;
+        }
+
+        req.corr_id = next_corr_id;
+        req.opts = *opts;
+        req.deadline = now + opts->timeout_ticks;
+        *corr_id_out = next_corr_id;
+
+        next_corr_id += 1;
+        if (next_corr_id == 0) {
+            next_corr_id = 1;
+        }
+
+        if (opts->timeout_ticks != portMAX_DELAY && !sweep_armed) {
+            sweep_armed = true;
+            need_arm = true;
+        }
+
+        ret = ESP_OK;
+        break;
+    }
+    taskEXIT_CRITICAL(&lock);
+
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Too many outstanding reports");
+    }
+
+    if (need_arm) {
+        arm_sweep();
+    }
+
+    return ret;
+}
+
+esp_err_t report_tracker::cancel(uint32_t corr_id)
+{
+    esp_err_t ret = ESP_ERR_NOT_FOUND;
+    taskENTER_CRITICAL(&lock);
+    for (auto &req : pending) {
+        if (corr_id != 0 && req.corr_id == corr_id) {
+            req = {};
+            ret = ESP_OK;
+            break;
+        }
+    }
+    taskEXIT_CRITICAL(&lock);
+
+    return ret;
+}
+
+esp_err_t report_tracker::on_report_response(uint32_t corr_id, esp_err_t state, const uint8_t *payload, size_t len)
+{
+    if (corr_id == 0) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    pending_req matched = {};
+    taskENTER_CRITICAL(&lock);
+    for (auto &req : pending) {
+        if (req.corr_id == corr_id) {
+            matched = req;
+            req = {};
+            break;
+        }
+    }
+    taskEXIT_CRITICAL(&lock);
+
+    if (matched.corr_id == 0) {
+        ESP_LOGW(TAG, "Late or unknown response, cid=%lu", corr_id);
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    report_completion completion = {};
+    completion.corr_id = corr_id;
+    completion.state = state;
+    completion.len = std::min(len, sizeof(completion.payload));
+    if (payload != nullptr && completion.len > 0) {
+        memcpy(completion.payload, payload, completion.len);
+    }
+
+    deliver(&matched.opts, &completion);
+    return ESP_OK;
+}
+
+size_t report_tracker::outstanding() const
+{
+    size_t count = 0;
+    for (const auto &req : pending) {
+        count += (req.corr_id != 0) ? 1 : 0;
+    }
+
+    return count;
+}
+
+void report_tracker::sweep_cb(TimerHandle_t timer)
+{
+    auto *ctx = (report_tracker *)pvTimerGetTimerID(timer);
+    if (ctx != nullptr) {
+        ctx->expire_overdue();
+    }
+}
+
+void report_tracker::arm_sweep()
+{
+    // No blocking: this may run on the timer task itself, i.e. from the sweep or a done_cb
+    if (sweep_timer == nullptr || xTimerStart(sweep_timer, 0) != pdPASS) {
+        ESP_LOGE(TAG, "Failed to arm sweep timer");
+        taskENTER_CRITICAL(&lock);
+        sweep_armed = false; // Let the next begin() try again
+        taskEXIT_CRITICAL(&lock);
+    }
+}
+
+void report_tracker::deliver(const report_req_opts *opts, const report_completion *completion)
+{
+    if (opts->done_cb != nullptr) {
+        opts->done_cb(completion, opts->user_ctx);
+    }
+
+    if (opts->done_queue != nullptr && xQueueSend(opts->done_queue, completion, 0) != pdTRUE) {
+        ESP_LOGW(TAG, "Completion queue full, cid=%lu dropped", completion->corr_id);
+    }
+}
+
+void report_tracker::expire_overdue()
+{
+    TickType_t now = xTaskGetTickCount();
+    for (auto &req : pending) {
+        pending_req expired = {};
+        taskENTER_CRITICAL(&lock);
+        if (req.corr_id != 0 && req.opts.timeout_ticks != portMAX_DELAY && (int32_t)(now - req.deadline) >= 0) {
+            expired = req;
+            req = {};
+        }
+        taskEXIT_CRITICAL(&lock);
+
+        if (expired.corr_id == 0) {
+            continue;
+        }
+
+        ESP_LOGW(TAG, "Report timeout, cid=%lu", expired.corr_id);
+        report_completion completion = {};
+        completion.corr_id = expired.corr_id;
+        completion.state = ESP_ERR_TIMEOUT;
+        deliver(&expired.opts, &completion);
+    }
+
+    // Re-arm only while something can still time out, otherwise go idle until the next begin()
+    bool need_arm = false;
+    taskENTER_CRITICAL(&lock);
+    for (const auto &req : pending) {
+        if (req.corr_id != 0 && req.opts.timeout_ticks != portMAX_DELAY) {
+            need_arm = true;
+            break;
+        }
+    }
+
+    sweep_armed = need_arm;
+    taskEXIT_CRITICAL(&lock);
+
+    if (need_arm) {
+        arm_sweep();
+    }
+}
+
+report_tracker::~report_tracker()
+{
+    if (sweep_timer != nullptr) {
+        xTimerDelete(sweep_timer, portMAX_DELAY);
+    }
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <esp_err.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/timers.h>
+#include "reporter.hpp"
+
+/**
+ * Keeps track of outstanding asynchronous reports, and completes them on response or timeout
+ *
+ * @remark Correlation IDs are never 0, 0 means "no correlation" on the wire
+ * @remark The sweep timer is one-shot, armed by begin() and re-armed by the sweep only while a report with a finite
+ *         timeout is outstanding, so an idle tracker costs no timer wakeups
+ */
+class report_tracker : public async_report_response_if
+{
+public:
+    static constexpr size_t MAX_OUTSTANDING = 16;
+    static constexpr uint32_t SWEEP_PERIOD_MS = 100;
+
+public:
+    report_tracker() = default;
+    ~report_tracker();
+    esp_err_t init();
+    esp_err_t begin(const report_req_opts *opts, uint32_t *corr_id_out);
+    esp_err_t cancel(uint32_t corr_id);
+    esp_err_t on_report_response(uint32_t corr_id, esp_err_t state, const uint8_t *payload, size_t len) override;
+    [[nodiscard]] size_t outstanding() const;
+
+private:
+    struct pending_req {
+        uint32_t corr_id;
+        TickType_t deadline;
+        report_req_opts opts;
+    };
+
+    static void sweep_cb(TimerHandle_t timer);
+    void arm_sweep();
+    static void deliver(const report_req_opts *opts, const report_completion *completion);
+    void expire_overdue();
+
+private:
+    portMUX_TYPE lock = portMUX_INITIALIZER_UNLOCKED;
+    TimerHandle_t sweep_timer = nullptr;
+    bool sweep_armed = false; // Under lock, so begin() & the sweep agree on who arms the timer next
+    uint32_t next_corr_id = 1;
+    pending_req pending[MAX_OUTSTANDING] = {};
+
+    static const constexpr char TAG[] = "report_trk";
+};
@@ -1,6 +1,10 @@
 #pragma once
 
+#include <cstdint>
+#include <cstddef>
 #include <esp_err.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
 
 class reporter_if
 {
@@ -13,4 +17,52 @@ class report_response_if
 {
 public:
     virtual esp_err_t on_report_response(esp_err_t state, const uint8_t *payload, size_t len) = 0;
-};
\ No newline at end of file
+};
+
+/**
+ * Completion of one asynchronous report, matched to its request by corr_id
+ *
+ * @remark state is ESP_ERR_TIMEOUT when no response arrived in time
+ * @remark payload is copied in, responses longer than MAX_PAYLOAD_LEN are truncated
+ */
+struct report_completion
+{
+    static constexpr size_t MAX_PAYLOAD_LEN = 128;
+
+    uint32_t corr_id;
+    esp_err_t state;
+    size_t len;
+    uint8_t payload[MAX_PAYLOAD_LEN];
+};
+
+typedef void (*report_done_cb_t)(const report_completion *completion, void *user_ctx);
+
+/**
+ * Where a completion goes: the callback (called from the response/timer context, keep it short),
+ * and/or a queue of report_completion items
+ *
+ * @remark timeout_ticks of portMAX_DELAY never times out, so it holds a tracker slot until the backend answers
+ */
+struct report_req_opts
+{
+    static constexpr uint32_t DEFAULT_TIMEOUT_MS = 30000;
+
+    report_done_cb_t done_cb = nullptr;
+    void *user_ctx = nullptr;
+    QueueHandle_t done_queue = nullptr;
+    uint32_t timeout_ticks = pdMS_TO_TICKS(DEFAULT_TIMEOUT_MS);
+};
+
+class async_reporter_if
+{
+public:
+    virtual esp_err_t send_target_ident_async(const uint8_t *target_sn, size_t sn_len, const uint8_t *fw_sha256, const uint8_t *algo_sha256,
+                                              const report_req_opts *opts, uint32_t *corr_id_out) = 0;
+    virtual esp_err_t send_test_report_async(const uint8_t *payload, size_t len, const report_req_opts *opts, uint32_t *corr_id_out) = 0;
+};
+
+class async_report_response_if
+{
+public:
+    virtual esp_err_t on_report_response(uint32_t corr_id, esp_err_t state, const uint8_t *payload, size_t len) = 0;
+};
@@ -0,0 +1,444 @@
+/**
+ * Host-side fleet simulation for reconnect_scheduler, no ESP-IDF needed
+ *
+ * @remark Build: g++ -std=c++20 -O2 -Icomm tools/reconnect_sim.cpp comm/reconnect_scheduler.cpp -o reconnect_sim
+ * @remark Deterministic mode (default): N clients with seeds seed..seed+N-1 lose the broker at t=0, it comes back
+ *         at --restart-ms and then accepts at most --accept-per-sec connects a second. Runs in virtual time, so the
+ *         same arguments always print the same report & checksum. --naive replays the old behaviour
+ *         (fixed esp-mqtt retry interval, no settle delay) for comparison
+ * @remark --reconnect-fail-pct P: that share of esp_mqtt_client_reconnect() calls fail locally (i.e. out of sockets),
+ *         the attempt never reaches the broker and the client backs off again like mqtt_client::reconnect_timer_cb().
+ *         --no-rearm replays the old handling, where such a client never tries again
+ * @remark Live mode (--broker host[:port]): N real MQTT 3.1.1 connections to a local broker, driven by the same
+ *         schedulers on wall-clock time. Restart the broker while it runs, i.e. "systemctl restart mosquitto"
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+#include <string>
+#include <vector>
+#include <queue>
+#include <chrono>
+#include <algorithm>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include "reconnect_scheduler.hpp"
+
+namespace
+{
+    struct sim_args
+    {
+        uint32_t clients = 200;
+        uint32_t seed = 1;
+        int64_t restart_ms = 5000;
+        uint32_t accept_per_sec = 50;
+        int64_t max_ms = 600000;
+        bool naive = false;
+        uint32_t reconnect_fail_pct = 0;
+        bool no_rearm = false;
+        const char *broker = nullptr;
+        int64_t duration_ms = 120000;
+    };
+
+    constexpr uint32_t NAIVE_RETRY_MS = 10000; // esp-mqtt's default reconnect_timeout_ms
+
+    // Per-second counters, for the peaks the broker actually sees
+    struct rate_stats
+    {
+        std::vector<uint32_t> attempts;
+        std::vector<uint32_t> settles;
+
+        static void bump(std::vector<uint32_t> &buckets, int64_t now_ms)
+        {
+            auto sec = (size_t)std::max((int64_t)0, now_ms / 1000);
+            if (buckets.size() <= sec) {
+                buckets.resize(sec + 1, 0);
+            }
+
+            buckets[sec] += 1;
+        }
+
+        static uint32_t peak(const std::vector<uint32_t> &buckets)
+        {
+            return buckets.empty() ? 0 : *std::max_element(buckets.begin(), buckets.end());
+        }
+    };
+
+    uint64_t fnv1a(uint64_t hash, uint64_t val)
+    {
+        for (size_t idx = 0; idx < sizeof(val); idx += 1) {
+            hash ^= (val >> (idx * 8)) & 0xff;
+            hash *= 0x100000001b3ULL;
+        }
+
+        return hash;
+    }
+
+    enum sim_evt_type : uint32_t {
+        SIM_EVT_ATTEMPT = 0,
+        SIM_EVT_SETTLED = 1,
+    };
+
+    struct sim_evt
+    {
+        int64_t at_ms;
+        uint64_t seq; // Tie-breaker, keeps the order total & therefore deterministic
+        uint32_t client;
+        sim_evt_type type;
+
+        bool operator>(const sim_evt &other) const
+        {
+            return at_ms != other.at_ms ? at_ms > other.at_ms : seq > other.seq;
+        }
+    };
+
+    int run_deterministic(const sim_args &args)
+    {
+        std::vector<reconnect_scheduler> scheds(args.clients);
+        std::priority_queue<sim_evt, std::vector<sim_evt>, std::greater<>> events;
+        std::vector<uint32_t> accepted_in_sec;
+        rate_stats stats = {};
+        uint64_t seq = 0;
+        uint64_t checksum = 0xcbf29ce484222325ULL;
+        uint64_t total_attempts = 0;
+        uint64_t refused = 0;
+        uint64_t call_failed = 0;
+        uint32_t stranded = 0;
+        uint32_t fail_rng = args.seed ^ 0x9e3779b9U; // Own stream, a fail-pct of 0 leaves the schedules untouched
+        uint32_t connected = 0;
+        uint32_t settled = 0;
+        int64_t all_connected_ms = -1;
+        int64_t all_settled_ms = -1;
+
+        // Everyone has been up for long enough to count as healthy, then the broker goes away at t=0
+        for (uint32_t idx = 0; idx < args.clients; idx += 1) {
+            auto &sched = scheds[idx];
+            sched.seed(args.seed + idx);
+            sched.on_connected(-reconnect_scheduler::STABLE_MS - 1);
+            sched.on_settled();
+
+            uint32_t delay_ms = args.naive ? NAIVE_RETRY_MS : sched.on_disconnected(0);
+            events.push({delay_ms, seq++, idx, SIM_EVT_ATTEMPT});
+        }
+
+        while (!events.empty() && settled < args.clients) {
+            sim_evt evt = events.top();
+            events.pop();
+            if (evt.at_ms > args.max_ms) {
+                break;
+            }
+
+            auto &sched = scheds[evt.client];
+            bool accepted = false;
+            if (evt.type == SIM_EVT_ATTEMPT) {
+                sched.on_attempt(evt.at_ms);
+                if (args.reconnect_fail_pct > 0) {
+                    fail_rng ^= fail_rng << 13;
+                    fail_rng ^= fail_rng >> 17;
+                    fail_rng ^= fail_rng << 5;
+                }
+
+                if (args.reconnect_fail_pct > 0 && fail_rng % 100 < args.reconnect_fail_pct) {
+                    // The call itself failed, nothing went out & no DISCONNECTED follows, only a re-armed timer retries
+                    call_failed += 1;
+                    if (args.no_rearm) {
+                        stranded += 1;
+                    } else {
+                        uint32_t delay_ms = sched.on_disconnected(evt.at_ms);
+                        events.push({evt.at_ms + (args.naive ? NAIVE_RETRY_MS : delay_ms), seq++, evt.client, SIM_EVT_ATTEMPT});
+                    }
+
+                    checksum = fnv1a(checksum, (uint64_t)evt.at_ms);
+                    checksum = fnv1a(checksum, ((uint64_t)evt.client << 2) | 0x3);
+                    continue;
+                }
+
+                total_attempts += 1;
+                rate_stats::bump(stats.attempts, evt.at_ms);
+
+                if (evt.at_ms >= args.restart_ms) {
+                    auto sec = (size_t)(evt.at_ms / 1000);
+                    if (accepted_in_sec.size() <= sec) {
+                        accepted_in_sec.resize(sec + 1, 0);
+                    }
+
+                    accepted = accepted_in_sec[sec] < args.accept_per_sec;
+                    accepted_in_sec[sec] += accepted ? 1 : 0;
+                }
+
+                if (accepted) {
+                    uint32_t settle_ms = sched.on_connected(evt.at_ms);
+                    events.push({evt.at_ms + (args.naive ? 0 : settle_ms), seq++, evt.client, SIM_EVT_SETTLED});
+                    connected += 1;
+                    if (connected == args.clients) {
+                        all_connected_ms = evt.at_ms;
+                    }
+                } else {
+                    refused += 1;
+                    uint32_t delay_ms = sched.on_disconnected(evt.at_ms);
+                    events.push({evt.at_ms + (args.naive ? NAIVE_RETRY_MS : delay_ms), seq++, evt.client, SIM_EVT_ATTEMPT});
+                }
+            } else {
+                sched.on_settled();
+                rate_stats::bump(stats.settles, evt.at_ms);
+                settled += 1;
+                if (settled == args.clients) {
+                    all_settled_ms = evt.at_ms;
+                }
+            }
+
+            checksum = fnv1a(checksum, (uint64_t)evt.at_ms);
+            checksum = fnv1a(checksum, ((uint64_t)evt.client << 2) | ((uint64_t)evt.type << 1) | (accepted ? 1 : 0));
+        }
+
+        printf("mode=%s clients=%u seed=%u restart_ms=%lld accept_per_sec=%u\n", args.naive ? "naive" : "jitter",
+               args.clients, args.seed, (long long)args.restart_ms, args.accept_per_sec);
+        printf("attempts=%llu refused=%llu peak_attempts_per_sec=%u peak_settles_per_sec=%u\n",
+               (unsigned long long)total_attempts, (unsigned long long)refused, rate_stats::peak(stats.attempts), rate_stats::peak(stats.settles));
+        printf("all_connected_ms=%lld all_settled_ms=%lld\n", (long long)all_connected_ms, (long long)all_settled_ms);
+        if (args.reconnect_fail_pct > 0) {
+            printf("reconnect_fail_pct=%u failed_calls=%llu stranded=%u\n", args.reconnect_fail_pct, (unsigned long long)call_failed, stranded);
+        }
+
+        printf("checksum=%016llx\n", (unsigned long long)checksum);
+        return settled == args.clients ? 0 : 1;
+    }
+
+    int64_t now_ms()
+    {
+        using namespace std::chrono;
+        return duration_cast<milliseconds>(steady_clock::now().time_since_epoch()).count();
+    }
+
+    enum live_state : uint32_t {
+        LIVE_WAITING = 0, // Backing off
+        LIVE_TCP_CONNECTING = 1,
+        LIVE_AWAIT_CONNACK = 2,
+        LIVE_SETTLING = 3,
+        LIVE_UP = 4,
+    };
+
+    struct live_client
+    {
+        reconnect_scheduler sched{};
+        live_state state = LIVE_WAITING;
+        int fd = -1;
+        int64_t due_ms = 0; // Next attempt while WAITING, settle deadline while SETTLING
+        uint8_t rx_buf[4] = {};
+        size_t rx_len = 0;
+    };
+
+    void live_close(live_client &client)
+    {
+        if (client.fd >= 0) {
+            close(client.fd);
+            client.fd = -1;
+        }
+
+        client.rx_len = 0;
+    }
+
+    void live_drop(live_client &client, int64_t now, int64_t start)
+    {
+        live_close(client);
+        client.state = LIVE_WAITING;
+        client.due_ms = now + client.sched.on_disconnected(now - start);
+    }
+
+    bool live_send_connect(live_client &client, uint32_t idx)
+    {
+        // MQTT 3.1.1 CONNECT, clean session, 60s keep-alive, client ID "sim-<idx>"
+        char client_id[24] = {};
+        int id_len = snprintf(client_id, sizeof(client_id), "sim-%u", idx);
+        uint8_t pkt[64] = {};
+        size_t pos = 0;
+        size_t remain = 10 + 2 + (size_t)id_len;
+        pkt[pos++] = 0x10;
+        pkt[pos++] = (uint8_t)remain;
+        const uint8_t var_hdr[] = {0x00, 0x04, 'M', 'Q', 'T', 'T', 0x04, 0x02, 0x00, 60};
+        memcpy(pkt + pos, var_hdr, sizeof(var_hdr));
+        pos += sizeof(var_hdr);
+        pkt[pos++] = 0;
+        pkt[pos++] = (uint8_t)id_len;
+        memcpy(pkt + pos, client_id, id_len);
+        pos += id_len;
+        return send(client.fd, pkt, pos, MSG_NOSIGNAL) == (ssize_t)pos;
+    }
+
+    int run_live(const sim_args &args)
+    {
+        std::string host = args.broker;
+        std::string port = "1883";
+        auto colon = host.rfind(':');
+        if (colon != std::string::npos) {
+            port = host.substr(colon + 1);
+            host = host.substr(0, colon);
+        }
+
+        addrinfo hints = {};
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        addrinfo *addr = nullptr;
+        if (getaddrinfo(host.c_str(), port.c_str(), &hints, &addr) != 0 || addr == nullptr) {
+            fprintf(stderr, "Can't resolve %s:%s\n", host.c_str(), port.c_str());
+            return 2;
+        }
+
+        std::vector<live_client> clients(args.clients);
+        rate_stats stats = {};
+        int64_t start = now_ms();
+        for (uint32_t idx = 0; idx < args.clients; idx += 1) {
+            clients[idx].sched.seed(args.seed + idx);
+            clients[idx].due_ms = start + clients[idx].sched.on_disconnected(0); // Cold boot of the whole fleet
+        }
+
+        std::vector<pollfd> pfds;
+        std::vector<uint32_t> pfd_owner;
+        while (now_ms() - start < args.duration_ms) {
+            int64_t now = now_ms();
+            for (uint32_t idx = 0; idx < args.clients; idx += 1) {
+                auto &client = clients[idx];
+                if (client.state == LIVE_WAITING && now >= client.due_ms) {
+                    client.sched.on_attempt(now - start);
+                    rate_stats::bump(stats.attempts, now - start);
+                    client.fd = socket(addr->ai_family, addr->ai_socktype | SOCK_NONBLOCK, addr->ai_protocol);
+                    if (client.fd < 0 || (connect(client.fd, addr->ai_addr, addr->ai_addrlen) != 0 && errno != EINPROGRESS)) {
+                        live_drop(client, now, start);
+                        continue;
+                    }
+
+                    client.state = LIVE_TCP_CONNECTING;
+                } else if (client.state == LIVE_SETTLING && now >= client.due_ms) {
+                    client.sched.on_settled();
+                    client.state = LIVE_UP;
+                    rate_stats::bump(stats.settles, now - start);
+                }
+            }
+
+            pfds.clear();
+            pfd_owner.clear();
+            for (uint32_t idx = 0; idx < args.clients; idx += 1) {
+                auto &client = clients[idx];
+                if (client.fd < 0) {
+                    continue;
+                }
+
+                pfds.push_back({client.fd, (short)(client.state == LIVE_TCP_CONNECTING ? POLLOUT : POLLIN), 0});
+                pfd_owner.push_back(idx);
+            }
+
+            poll(pfds.data(), pfds.size(), 10);
+            now = now_ms();
+            for (size_t pidx = 0; pidx < pfds.size(); pidx += 1) {
+                if (pfds[pidx].revents == 0) {
+                    continue;
+                }
+
+                uint32_t idx = pfd_owner[pidx];
+                auto &client = clients[idx];
+                if (client.state == LIVE_TCP_CONNECTING) {
+                    int so_err = 0;
+                    socklen_t so_len = sizeof(so_err);
+                    getsockopt(client.fd, SOL_SOCKET, SO_ERROR, &so_err, &so_len);
+                    if (so_err != 0 || !live_send_connect(client, idx)) {
+                        live_drop(client, now, start);
+                        continue;
+                    }
+
+                    client.state = LIVE_AWAIT_CONNACK;
+                    continue;
+                }
+
+                ssize_t read_len = recv(client.fd, client.rx_buf + client.rx_len, sizeof(client.rx_buf) - client.rx_len, 0);
+                if (read_len <= 0) {
+                    live_drop(client, now, start); // Broker went away
+                    continue;
+                }
+
+                client.rx_len += read_len;
+                if (client.state == LIVE_AWAIT_CONNACK && client.rx_len >= 4) {
+                    if (client.rx_buf[0] != 0x20 || client.rx_buf[3] != 0) {
+                        live_drop(client, now, start); // Refused, i.e. broker connection limit
+                        continue;
+                    }
+
+                    client.state = LIVE_SETTLING;
+                    client.due_ms = now + client.sched.on_connected(now - start);
+                }
+
+                client.rx_len = 0; // Only the CONNACK matters, anything later is just drained
+            }
+        }
+
+        uint32_t up = 0;
+        for (auto &client : clients) {
+            up += client.state == LIVE_UP ? 1 : 0;
+            live_close(client);
+        }
+
+        freeaddrinfo(addr);
+        printf("broker=%s clients=%u seed=%u duration_ms=%lld\n", args.broker, args.clients, args.seed, (long long)args.duration_ms);
+        printf("peak_attempts_per_sec=%u peak_settles_per_sec=%u up_at_end=%u\n",
+               rate_stats::peak(stats.attempts), rate_stats::peak(stats.settles), up);
+        for (size_t sec = 0; sec < stats.attempts.size(); sec += 1) {
+            uint32_t settles = sec < stats.settles.size() ? stats.settles[sec] : 0;
+            if (stats.attempts[sec] > 0 || settles > 0) {
+                printf("  t=%3zus attempts=%u settles=%u\n", sec, stats.attempts[sec], settles);
+            }
+        }
+
+        return up == args.clients ? 0 : 1;
+    }
+
+    bool parse_args(int argc, char **argv, sim_args *args)
+    {
+        for (int idx = 1; idx < argc; idx += 1) {
+            std::string arg = argv[idx];
+            bool has_val = idx + 1 < argc;
+            if (arg == "--naive") {
+                args->naive = true;
+            } else if (arg == "--clients" && has_val) {
+                args->clients = (uint32_t)strtoul(argv[++idx], nullptr, 0);
+            } else if (arg == "--seed" && has_val) {
+                args->seed = (uint32_t)strtoul(argv[++idx], nullptr, 0);
+            } else if (arg == "--restart-ms" && has_val) {
+                args->restart_ms = strtoll(argv[++idx], nullptr, 0);
+            } else if (arg == "--accept-per-sec" && has_val) {
+                args->accept_per_sec = (uint32_t)strtoul(argv[++idx], nullptr, 0);
+            } else if (arg == "--max-ms" && has_val) {
+                args->max_ms = strtoll(argv[++idx], nullptr, 0);
+            } else if (arg == "--reconnect-fail-pct" && has_val) {
+                args->reconnect_fail_pct = (uint32_t)strtoul(argv[++idx], nullptr, 0);
+            } else if (arg == "--no-rearm") {
+                args->no_rearm = true;
+            } else if (arg == "--broker" && has_val) {
+                args->broker = argv[++idx];
+            } else if (arg == "--duration-ms" && has_val) {
+                args->duration_ms = strtoll(argv[++idx], nullptr, 0);
+            } else {
+                return false;
+            }
+        }
+
+        return args->clients > 0 && args->accept_per_sec > 0 && args->reconnect_fail_pct <= 100;
+    }
+}
+
+int main(int argc, char **argv)
+{
+    sim_args args = {};
+    if (!parse_args(argc, argv, &args)) {
+        fprintf(stderr, "Usage: %s [--clients N] [--seed S] [--restart-ms MS] [--accept-per-sec N] [--max-ms MS] [--naive]\n"
+                        "       %s [...] --reconnect-fail-pct P [--no-rearm]\n"
+                        "       %s --broker host[:port] [--clients N] [--seed S] [--duration-ms MS]\n", argv[0], argv[0], argv[0]);
+        return 2;
+    }
+
+    return args.broker != nullptr ? run_live(args) : run_deterministic(args);
+}
@@ -3,6 +3,7 @@
 #include <esp_err.h>
 #include <esp_log.h>
 #include <lvgl.h>
+#include <stream_stats.hpp>
 
 class ui_composer
 {
@@ -33,6 +34,14 @@ public:
     virtual esp_err_t display_current(double min_ua, double max_ua, double avg_ua, const char *state, lv_color_t state_color) = 0;
     virtual void wait_and_start_render() = 0;
     virtual void render_done() = 0;
+
+    /**
+     * Show a stream_stats window, i.e. from the power consumption test
+     */
+    esp_err_t display_current_stats(const stat_snapshot &stats, const char *state, lv_color_t state_color)
+    {
+        return display_current(stats.min, stats.max, stats.mean, state, state_color);
+    }
 };
 
 class ui_screen
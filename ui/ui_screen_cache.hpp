@@ -0,0 +1,163 @@
+#pragma once
+
+#include <esp_timer.h>
+#include "ui_if.hpp"
+
+/**
+ * Builds every ui_screen once into its own hidden container, then switches screens by flipping LV_OBJ_FLAG_HIDDEN
+ *
+ * @remark init() of each screen runs once in build(), no LVGL objects get created or laid out while programming,
+ *         a state change only touches the hidden flag of two containers, later updates only touch bound values
+ * @remark All calls touch LVGL, so they must run with the LVGL lock held (between wait_and_start_render() and render_done())
+ * @remark get_last_switch_us() keeps the cost of the last show() including the lv_refr_now() redraw it forces,
+ *         so it compares like for like against rebuilding a screen in the headless Linux build
+ * @remark Call destroy() under the LVGL lock before dropping the cache, the destructor doesn't touch LVGL
+ */
+class ui_screen_cache
+{
+private:
+    static const constexpr char TAG[] = "ui_scr_cache";
+    static constexpr size_t MAX_SCREENS = ui_screen::MESSAGE + 1;
+
+public:
+    ui_screen_cache() = default;
+    ui_screen_cache(const ui_screen_cache &) = delete;
+    ui_screen_cache &operator=(const ui_screen_cache &) = delete;
+
+    ~ui_screen_cache()
+    {
+        for (auto &cached : screens) {
+            if (cached.container != nullptr) {
+                ESP_LOGW(TAG, "Dropped without destroy(), containers leak");
+                break;
+            }
+        }
+    }
+
+    esp_err_t add_screen(ui_screen::state id, ui_screen *screen)
+    {
+        if (id == ui_screen::CLEAR || (size_t)id >= MAX_SCREENS || screen == nullptr) {
+            return ESP_ERR_INVALID_ARG;
+        }
+
+        if (screens[id].container != nullptr) {
+            return ESP_ERR_INVALID_STATE; // Already built, add everything before build()
+        }
+
+        screens[id].screen = screen;
+        return ESP_OK;
+    }
+
+    esp_err_t build(lv_obj_t *parent)
+    {
+        if (parent == nullptr) {
+            return ESP_ERR_INVALID_ARG;
+        }
+
+        for (size_t idx = 0; idx < MAX_SCREENS; idx += 1) {
+            auto &cached = screens[idx];
+            if (cached.screen == nullptr || cached.container != nullptr) {
+                continue;
+            }
+
+            cached.container = lv_obj_create(parent);
+            if (cached.container == nullptr) {
+                ESP_LOGE(TAG, "Failed to create container for screen %u", idx);
+                return ESP_ERR_NO_MEM;
+            }
+
+            lv_obj_remove_style_all(cached.container);
+            lv_obj_set_size(cached.container, lv_pct(100), lv_pct(100));
+            lv_obj_clear_flag(cached.container, LV_OBJ_FLAG_SCROLLABLE);
+            lv_obj_add_flag(cached.container, LV_OBJ_FLAG_HIDDEN);
+
+            auto ret = cached.screen->init(cached.container);
+            if (ret != ESP_OK) {
+                ESP_LOGE(TAG, "Screen %u init failed: 0x%x", idx, ret);
+                lv_obj_del(cached.container);
+                cached.container = nullptr;
+                return ret;
+            }
+        }
+
+        active = ui_screen::CLEAR;
+        return ESP_OK;
+    }
+
+    /**
+     * Show one prebuilt screen and hide the previous one, ui_screen::CLEAR hides everything
+     *
+     * @remark Redraws right away with lv_refr_now(), rather than on the next LVGL timer tick
+     */
+    esp_err_t show(ui_screen::state id)
+    {
+        if ((size_t)id >= MAX_SCREENS) {
+            return ESP_ERR_INVALID_ARG;
+        }
+
+        if (id != ui_screen::CLEAR && screens[id].container == nullptr) {
+            return ESP_ERR_NOT_FOUND;
+        }
+
+        if (id == active) {
+            return ESP_OK;
+        }
+
+        int64_t start_us = esp_timer_get_time();
+        if (active != ui_screen::CLEAR && screens[active].container != nullptr) {
+            lv_obj_add_flag(screens[active].container, LV_OBJ_FLAG_HIDDEN);
+        }
+
+        if (id != ui_screen::CLEAR) {
+            lv_obj_clear_flag(screens[id].container, LV_OBJ_FLAG_HIDDEN);
+        }
+
+        active = id;
+        lv_refr_now(nullptr);
+        last_switch_us = esp_timer_get_time() - start_us;
+        return ESP_OK;
+    }
+
+    [[nodiscard]] ui_screen *get_screen(ui_screen::state id) const
+    {
+        return (size_t)id < MAX_SCREENS ? screens[id].screen : nullptr;
+    }
+
+    [[nodiscard]] ui_screen::state get_active() const
+    {
+        return active;
+    }
+
+    [[nodiscard]] int64_t get_last_switch_us() const
+    {
+        return last_switch_us;
+    }
+
+    /**
+     * Deinit every screen and delete its container, with the LVGL lock held
+     */
+    void destroy()
+    {
+        for (auto &cached : screens) {
+            if (cached.container == nullptr) {
+                continue;
+            }
+
+            cached.screen->deinit();
+            lv_obj_del(cached.container);
+            cached.container = nullptr;
+        }
+
+        active = ui_screen::CLEAR;
+    }
+
+private:
+    struct cached_screen {
+        ui_screen *screen;
+        lv_obj_t *container;
+    };
+
+    cached_screen screens[MAX_SCREENS] = {};
+    ui_screen::state active = ui_screen::CLEAR;
+    int64_t last_switch_us = 0;
+};
@@ -0,0 +1,465 @@
+#pragma once
+
+#include <cstring>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <esp_timer.h>
+#include "ui_if.hpp"
+
+/**
+ * Coalescing, rate-limited front-end for a ui_composer
+ *
+ * @remark display_*() only stores the latest state per widget and returns, it never waits for LVGL
+ * @remark A pump task flushes the pending states into the wrapped composer at most max_fps times a second,
+ *         each coalesced batch inside one wait_and_start_render()/render_done() pair, so it never races the
+ *         LVGL render. Only the pump task waits on the BIT_READY/BIT_NOT_RENDERING handshake, callers never do
+ * @remark Each widget keeps a few slot buffers: text gets copied into a free one outside the spinlock, the lock
+ *         only swaps indices. The pump copies the one it took out the same way
+ * @remark A screen change (init/done/error/config) supersedes any progress/current update queued before it
+ * @remark Destroying it stops the pump task after its current flush, pending updates are dropped
+ */
+class ui_update_queue : public ui_composer
+{
+private:
+    static const constexpr char TAG[] = "ui_queue";
+
+public:
+    static constexpr uint32_t DEFAULT_MAX_FPS = 15;
+    static constexpr size_t MAX_MSG_LEN = 96;
+    static constexpr uint8_t SLOT_BUFS = 4; // Pending + pump + up to two producers writing at once
+
+public:
+    explicit ui_update_queue(ui_composer *_composer, uint32_t _max_fps = DEFAULT_MAX_FPS)
+        : composer(_composer), frame_period_us(1000000ULL / (_max_fps == 0 ? DEFAULT_MAX_FPS : _max_fps)) {}
+
+    ui_update_queue(const ui_update_queue &) = delete;
+    ui_update_queue &operator=(const ui_update_queue &) = delete;
+
+    ~ui_update_queue()
+    {
+        stop();
+    }
+
+    /**
+     * Stop the pump task and wait for it to leave, so it never touches this object or the composer afterwards
+     *
+     * @remark Blocks for at most one flush, never call it from the pump task itself (i.e. from inside the composer)
+     */
+    void stop()
+    {
+        if (pump_handle == nullptr) {
+            return;
+        }
+
+        stopping = true;
+        xTaskNotifyGive(pump_handle);
+        while (!exited) {
+            vTaskDelay(1);
+        }
+
+        pump_handle = nullptr;
+    }
+
+    esp_err_t init() override
+    {
+        if (composer == nullptr) {
+            return ESP_ERR_INVALID_ARG;
+        }
+
+        auto ret = composer->init();
+        if (ret != ESP_OK) {
+            return ret;
+        }
+
+        stopping = false;
+        exited = false;
+        if (xTaskCreatePinnedToCore(pump_task, "ui_pump", 4096, this, tskIDLE_PRIORITY + 2, &pump_handle, tskNO_AFFINITY) != pdPASS) {
+            ESP_LOGE(TAG, "Failed to create pump task");
+            return ESP_ERR_NO_MEM;
+        }
+
+        return ESP_OK;
+    }
+
+    esp_err_t display_init() override
+    {
+        return post_screen(SCREEN_INIT, nullptr, nullptr);
+    }
+
+    esp_err_t display_erase(uint8_t percentage) override
+    {
+        return post_progress(PROGRESS_ERASE, percentage, 0, 0, nullptr);
+    }
+
+    esp_err_t display_test(size_t done, size_t total, const char *test_msg) override
+    {
+        return post_progress(PROGRESS_TEST, 0, done, total, test_msg);
+    }
+
+    esp_err_t display_program(uint8_t percentage) override
+    {
+        return post_progress(PROGRESS_PROGRAM, percentage, 0, 0, nullptr);
+    }
+
+    esp_err_t display_done() override
+    {
+        return post_screen(SCREEN_DONE, nullptr, nullptr);
+    }
+
+    esp_err_t display_error(const char *header, const char *err_msg) override
+    {
+        return post_screen(SCREEN_ERROR, header, err_msg);
+    }
+
+    esp_err_t display_config() override
+    {
+        return post_screen(SCREEN_CONFIG, nullptr, nullptr);
+    }
+
+    esp_err_t display_current(double min_ua, double max_ua, double avg_ua, const char *state, lv_color_t state_color) override
+    {
+        uint8_t idx = acquire(current);
+        if (idx == slot_pool<current_slot>::NONE) {
+            return ESP_ERR_NO_MEM;
+        }
+
+        auto &slot = current.bufs[idx];
+        slot.min_ua = min_ua;
+        slot.max_ua = max_ua;
+        slot.avg_ua = avg_ua;
+        slot.color = state_color;
+        copy_str(slot.state, state);
+
+        taskENTER_CRITICAL(&lock);
+        publish(current, idx);
+        taskEXIT_CRITICAL(&lock);
+
+        return kick();
+    }
+
+    void wait_and_start_render() override
+    {
+        composer->wait_and_start_render();
+    }
+
+    void render_done() override
+    {
+        composer->render_done();
+    }
+
+    [[nodiscard]] uint32_t get_dropped_count() const
+    {
+        return dropped_count;
+    }
+
+private:
+    enum screen_type : uint8_t {
+        SCREEN_INIT,
+        SCREEN_DONE,
+        SCREEN_ERROR,
+        SCREEN_CONFIG,
+    };
+
+    enum progress_type : uint8_t {
+        PROGRESS_ERASE,
+        PROGRESS_PROGRAM,
+        PROGRESS_TEST,
+    };
+
+    struct screen_slot {
+        uint32_t seq;
+        screen_type type;
+        char header[MAX_MSG_LEN];
+        char msg[MAX_MSG_LEN];
+    };
+
+    struct progress_slot {
+        uint32_t seq;
+        progress_type type;
+        uint8_t percentage;
+        size_t done;
+        size_t total;
+        char msg[MAX_MSG_LEN];
+    };
+
+    struct current_slot {
+        uint32_t seq;
+        double min_ua;
+        double max_ua;
+        double avg_ua;
+        lv_color_t color;
+        char state[MAX_MSG_LEN];
+    };
+
+    // Indices only change under the spinlock, a buffer is only written by whoever holds it in busy_mask or reading
+    template<typename T>
+    struct slot_pool {
+        static constexpr uint8_t NONE = UINT8_MAX;
+        T bufs[SLOT_BUFS];
+        uint8_t pending;
+        uint8_t reading;
+        uint8_t busy_mask;
+    };
+
+private:
+    static void copy_str(char *dst, const char *src)
+    {
+        if (src == nullptr) {
+            dst[0] = '\0';
+            return;
+        }
+
+        strncpy(dst, src, MAX_MSG_LEN - 1);
+        dst[MAX_MSG_LEN - 1] = '\0';
+    }
+
+    esp_err_t kick()
+    {
+        if (pump_handle == nullptr) {
+            return ESP_ERR_INVALID_STATE;
+        }
+
+        xTaskNotifyGive(pump_handle);
+        return ESP_OK;
+    }
+
+    /**
+     * Reserve a free buffer to fill outside the lock, NONE (and counted as dropped) if every one is in use
+     */
+    template<typename T>
+    uint8_t acquire(slot_pool<T> &pool)
+    {
+        uint8_t idx = slot_pool<T>::NONE;
+        taskENTER_CRITICAL(&lock);
+        for (uint8_t buf_idx = 0; buf_idx < SLOT_BUFS; buf_idx += 1) {
+            if (buf_idx != pool.pending && buf_idx != pool.reading && (pool.busy_mask & (1U << buf_idx)) == 0) {
+                pool.busy_mask |= (1U << buf_idx);
+                idx = buf_idx;
+                break;
+            }
+        }
+
+        if (idx == slot_pool<T>::NONE) {
+            dropped_count += 1;
+        }
+
+        taskEXIT_CRITICAL(&lock);
+        return idx;
+    }
+
+    // Lock held: the filled buffer becomes the pending one, replacing (and dropping) any older one
+    template<typename T>
+    void publish(slot_pool<T> &pool, uint8_t idx)
+    {
+        if (pool.pending != slot_pool<T>::NONE) {
+            dropped_count += 1;
+        }
+
+        pool.bufs[idx].seq = ++seq_counter;
+        pool.busy_mask &= ~(1U << idx);
+        pool.pending = idx;
+    }
+
+    // Lock held
+    template<typename T>
+    void drop_pending(slot_pool<T> &pool)
+    {
+        if (pool.pending != slot_pool<T>::NONE) {
+            pool.pending = slot_pool<T>::NONE;
+            dropped_count += 1;
+        }
+    }
+
+    /**
+     * Pump side: take the pending buffer under the lock, copy it out without it
+     */
+    template<typename T>
+    bool take(slot_pool<T> &pool, T *out)
+    {
+        taskENTER_CRITICAL(&lock);
+        pool.reading = pool.pending;
+        pool.pending = slot_pool<T>::NONE;
+        taskEXIT_CRITICAL(&lock);
+
+        if (pool.reading == slot_pool<T>::NONE) {
+            return false;
+        }
+
+        *out = pool.bufs[pool.reading];
+
+        taskENTER_CRITICAL(&lock);
+        pool.reading = slot_pool<T>::NONE;
+        taskEXIT_CRITICAL(&lock);
+        return true;
+    }
+
+    esp_err_t post_screen(screen_type type, const char *header, const char *msg)
+    {
+        uint8_t idx = acquire(screen);
+        if (idx == slot_pool<screen_slot>::NONE) {
+            return ESP_ERR_NO_MEM;
+        }
+
+        auto &slot = screen.bufs[idx];
+        slot.type = type;
+        copy_str(slot.header, header);
+        copy_str(slot.msg, msg);
+
+        taskENTER_CRITICAL(&lock);
+        // Whatever was pending for the old screen is stale now
+        drop_pending(progress);
+        drop_pending(current);
+        publish(screen, idx);
+        taskEXIT_CRITICAL(&lock);
+
+        return kick();
+    }
+
+    esp_err_t post_progress(progress_type type, uint8_t percentage, size_t done, size_t total, const char *msg)
+    {
+        uint8_t idx = acquire(progress);
+        if (idx == slot_pool<progress_slot>::NONE) {
+            return ESP_ERR_NO_MEM;
+        }
+
+        auto &slot = progress.bufs[idx];
+        slot.type = type;
+        slot.percentage = percentage;
+        slot.done = done;
+        slot.total = total;
+        copy_str(slot.msg, msg);
+
+        taskENTER_CRITICAL(&lock);
+        publish(progress, idx);
+        taskEXIT_CRITICAL(&lock);
+
+        return kick();
+    }
+
+    void flush_screen(const screen_slot &slot)
+    {
+        esp_err_t ret = ESP_OK;
+        switch (slot.type) {
+            case SCREEN_INIT: {
+                ret = composer->display_init();
+                break;
+            }
+            case SCREEN_DONE: {
+                ret = composer->display_done();
+                break;
+            }
+            case SCREEN_ERROR: {
+                ret = composer->display_error(slot.header, slot.msg);
+                break;
+            }
+            case SCREEN_CONFIG: {
+                ret = composer->display_config();
+                break;
+            }
+        }
+
+        if (ret != ESP_OK) {
+            ESP_LOGW(TAG, "Screen %u update failed: 0x%x", slot.type, ret);
+        }
+    }
+
+    void flush_progress(const progress_slot &slot)
+    {
+        esp_err_t ret = ESP_OK;
+        switch (slot.type) {
+            case PROGRESS_ERASE: {
+                ret = composer->display_erase(slot.percentage);
+                break;
+            }
+            case PROGRESS_PROGRAM: {
+                ret = composer->display_program(slot.percentage);
+                break;
+            }
+            case PROGRESS_TEST: {
+                ret = composer->display_test(slot.done, slot.total, slot.msg);
+                break;
+            }
+        }
+
+        if (ret != ESP_OK) {
+            ESP_LOGW(TAG, "Progress %u update failed: 0x%x", slot.type, ret);
+        }
+    }
+
+    void flush_current(const current_slot &slot)
+    {
+        auto ret = composer->display_current(slot.min_ua, slot.max_ua, slot.avg_ua, slot.state, slot.color);
+        if (ret != ESP_OK) {
+            ESP_LOGW(TAG, "Current update failed: 0x%x", ret);
+        }
+    }
+
+    static void pump_task(void *_ctx)
+    {
+        auto *ctx = (ui_update_queue *)_ctx;
+        int64_t last_flush_us = 0;
+
+        while (!ctx->stopping) {
+            ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+            if (ctx->stopping) {
+                break;
+            }
+
+            int64_t since_last = esp_timer_get_time() - last_flush_us;
+            if (since_last < (int64_t)ctx->frame_period_us) {
+                vTaskDelay(pdMS_TO_TICKS((ctx->frame_period_us - since_last) / 1000) + 1);
+            }
+
+            // Snapshot first, render without the spinlock so callers never wait on LVGL
+            screen_slot screen_snap = {};
+            progress_slot progress_snap = {};
+            current_slot current_snap = {};
+            bool has_screen = ctx->take(ctx->screen, &screen_snap);
+            bool has_progress = ctx->take(ctx->progress, &progress_snap);
+            bool has_current = ctx->take(ctx->current, &current_snap);
+            if (!has_screen && !has_progress && !has_current) {
+                continue;
+            }
+
+            ctx->composer->wait_and_start_render();
+
+            // Screen changes always go first, as post_screen() already dropped anything older than them
+            if (has_screen) {
+                ctx->flush_screen(screen_snap);
+            }
+
+            if (has_progress && has_current && current_snap.seq < progress_snap.seq) {
+                ctx->flush_current(current_snap);
+                has_current = false;
+            }
+
+            if (has_progress) {
+                ctx->flush_progress(progress_snap);
+            }
+
+            if (has_current) {
+                ctx->flush_current(current_snap);
+            }
+
+            ctx->composer->render_done();
+            last_flush_us = esp_timer_get_time();
+        }
+
+        // Last touch of ctx, stop() may free it right after this
+        ctx->exited = true;
+        vTaskDelete(nullptr);
+    }
+
+private:
+    ui_composer *composer = nullptr;
+    uint64_t frame_period_us = 0;
+    TaskHandle_t pump_handle = nullptr;
+    volatile bool stopping = false;
+    volatile bool exited = false;
+    portMUX_TYPE lock = portMUX_INITIALIZER_UNLOCKED;
+    uint32_t seq_counter = 0;
+    uint32_t dropped_count = 0;
+    slot_pool<screen_slot> screen = {{}, slot_pool<screen_slot>::NONE, slot_pool<screen_slot>::NONE, 0};
+    slot_pool<progress_slot> progress = {{}, slot_pool<progress_slot>::NONE, slot_pool<progress_slot>::NONE, 0};
+    slot_pool<current_slot> current = {{}, slot_pool<current_slot>::NONE, slot_pool<current_slot>::NONE, 0};
+};